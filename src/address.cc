@@ -23,9 +23,16 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cctype>
+#include <algorithm>
+
+#include <errno.h>
 
 #include <netinet/ip6.h>
 #include <arpa/inet.h>
+#include <net/if.h>
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 #include "ndppd.h"
 #include "address.h"
@@ -33,7 +40,29 @@
 
 NDPPD_NS_BEGIN
 
-std::list<ptr<route> > address::_addresses;
+struct address::table {
+    // The names of the interfaces each address is assigned to.
+    address_map<std::vector<std::string> > ifnames;
+
+    // The addresses assigned to each interface.
+    std::map<std::string, std::vector<address> > addresses;
+
+    void add(const address& addr, const std::string& ifname);
+
+    void remove(const address& addr, const std::string& ifname);
+
+    void swap(table& other);
+
+    void clear();
+};
+
+address::table address::_local;
+
+bool address::_netlink;
+
+bool address::_dumping;
+
+address::table address::_dump;
 
 int address::_ttl;
 
@@ -329,6 +358,11 @@ struct in6_addr& address::mask()
     return _mask;
 }
 
+const struct in6_addr& address::const_mask() const
+{
+    return _mask;
+}
+
 bool address::is_multicast() const
 {
     return _addr.s6_addr[0] == 0xff;
@@ -345,26 +379,92 @@ bool address::is_unicast() const
 
 void address::add(const address& addr, const std::string& ifname)
 {
-    ptr<route> rt(new route(addr, ifname));
-    // logger::debug() << "address::create() addr=" << addr << ", ifname=" << ifname;
-    _addresses.push_back(rt);
+    _local.add(addr, ifname);
 }
 
-std::list<ptr<route> >::iterator address::addresses_begin()
+void address::table::add(const address& addr, const std::string& ifname)
 {
-    return _addresses.begin();
+    std::vector<std::string>* names = ifnames.find(addr);
+
+    if (!names) {
+        ifnames.insert(addr, std::vector<std::string>(1, ifname));
+    } else if (std::find(names->begin(), names->end(), ifname) == names->end()) {
+        names->push_back(ifname);
+    } else {
+        return;
+    }
+
+    addresses[ifname].push_back(addr);
 }
 
-std::list<ptr<route> >::iterator address::addresses_end()
+void address::table::remove(const address& addr, const std::string& ifname)
 {
-    return _addresses.end();
+    std::vector<std::string>* names = ifnames.find(addr);
+
+    if (!names)
+        return;
+
+    std::vector<std::string>::iterator it = std::find(names->begin(), names->end(), ifname);
+
+    if (it == names->end())
+        return;
+
+    names->erase(it);
+
+    if (names->empty())
+        ifnames.remove(addr);
+
+    std::map<std::string, std::vector<address> >::iterator ait = addresses.find(ifname);
+
+    if (ait != addresses.end()) {
+        std::vector<address>& v = ait->second;
+
+        for (std::vector<address>::iterator vit = v.begin(); vit != v.end(); vit++) {
+            if (!memcmp(&vit->const_addr(), &addr.const_addr(), sizeof(struct in6_addr))) {
+                v.erase(vit);
+                break;
+            }
+        }
+
+        if (v.empty())
+            addresses.erase(ait);
+    }
+}
+
+void address::table::swap(table& other)
+{
+    ifnames.swap(other.ifnames);
+    addresses.swap(other.addresses);
+}
+
+void address::table::clear()
+{
+    ifnames.clear();
+    addresses.clear();
+}
+
+bool address::is_local(const address& addr)
+{
+    return _local.ifnames.find(addr) != NULL;
+}
+
+const std::vector<std::string>* address::local_ifnames(const address& addr)
+{
+    return _local.ifnames.find(addr);
+}
+
+const std::vector<address>* address::local_addresses(const std::string& ifname)
+{
+    std::map<std::string, std::vector<address> >::const_iterator it = _local.addresses.find(ifname);
+
+    return (it != _local.addresses.end()) ? &it->second : NULL;
 }
 
 void address::load(const std::string& path)
 {
-    // Hack to make sure the addresses are not freed prematurely.
-    std::list<ptr<route> > tmp_addresses(_addresses);
-    _addresses.clear();
+    // Load the addresses on the side, so that lookups never see a table
+    // that's only partially loaded.
+    table addresses;
 
     logger::debug() << "reading IP addresses";
 
@@ -395,24 +495,144 @@ void address::load(const std::string& path)
             
             std::string iface = route::token(buf + 45);
 
-            address::add(addr, iface);
+            addresses.add(addr, iface);
             
             logger::debug() << "found local addr=" << addr << ", iface=" << iface;
         }
     } catch (std::ifstream::failure e) {
         logger::warning() << "Failed to parse IPv6 address data from '" << path << "'";
         logger::error() << e.what();
+        return;
     }
+
+    _local.swap(addresses);
     
     logger::debug() << "completed IP addresses load";
+
+    iface::update_filters();
+}
+
+bool address::watch()
+{
+    rtnl::watch(RTM_NEWADDR, address::handle_rtnl);
+    rtnl::watch(RTM_DELADDR, address::handle_rtnl);
+
+    // Join the group before dumping, so that no change falls in between.
+
+    if (!rtnl::subscribe(RTNLGRP_IPV6_IFADDR, address::resync)) {
+        logger::warning() << "Unable to monitor addresses, falling back to reading /proc/net/if_inet6";
+        return false;
+    }
+
+    _netlink = true;
+
+    resync();
+
+    return _netlink;
+}
+
+void address::resync()
+{
+    _dumping = true;
+    _dump.clear();
+
+    if (!rtnl::dump(RTM_GETADDR, AF_INET6, address::handle_dump))
+        handle_dump(0, EIO, NULL);
+}
+
+void address::handle_dump(uint32_t seq, int error, void* data)
+{
+    // The addresses seen so far may be stale; keep _dumping set and wait
+    // for the dump the newer resync() queued.
+    if (error == ECANCELED) {
+        _dump.clear();
+        return;
+    }
+
+    _dumping = false;
+
+    if (error) {
+        logger::warning()
+            << "Failed to dump addresses (" << strerror(error)
+            << "), falling back to reading /proc/net/if_inet6";
+
+        _dump.clear();
+        _netlink = false;
+        _c_ttl   = 0;
+
+        loop::wakeup_in(0);
+        return;
+    }
+
+    _local.swap(_dump);
+    _dump.clear();
+
+    logger::debug() << "address::handle_dump() " << _local.ifnames.size() << " addresses";
+
+    iface::update_filters();
+}
+
+void address::handle_rtnl(const struct nlmsghdr* nlh)
+{
+    const struct ifaddrmsg* ifa = (const struct ifaddrmsg* )NLMSG_DATA(nlh);
+
+    if ((nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa))) || (ifa->ifa_family != AF_INET6))
+        return;
+
+    int len = IFA_PAYLOAD(nlh);
+
+    const void* local = NULL;
+    const void* addr  = NULL;
+
+    for (const struct rtattr* rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == IFA_LOCAL)
+            local = RTA_DATA(rta);
+        else if (rta->rta_type == IFA_ADDRESS)
+            addr = RTA_DATA(rta);
+    }
+
+    // On point-to-point links IFA_ADDRESS is the peer's address.
+
+    if (local)
+        addr = local;
+
+    char ifname[IF_NAMESIZE];
+
+    if (!addr || !if_indextoname(ifa->ifa_index, ifname))
+        return;
+
+    address a(*(const struct in6_addr* )addr);
+
+    table& t = _dumping ? _dump : _local;
+
+    if (nlh->nlmsg_type == RTM_NEWADDR) {
+        if (!_dumping)
+            logger::debug() << "address::handle_rtnl() added " << a << " dev " << ifname;
+
+        t.add(a, ifname);
+    } else {
+        logger::debug() << "address::handle_rtnl() removed " << a << " dev " << ifname;
+
+        t.remove(a, ifname);
+    }
+
+    // The local addresses of the rules' interfaces are part of the filter.
+    if (!_dumping)
+        iface::update_filters();
 }
 
 void address::update(int elapsed_time)
 {
+    // Nothing to do; we hear about changes as they happen.
+    if (_netlink)
+        return;
+
     if ((_c_ttl -= elapsed_time) <= 0) {
         load("/proc/net/if_inet6");
         _c_ttl = _ttl;
     }
+
+    loop::wakeup_in(_c_ttl);
 }
 
 int address::ttl()
@@ -17,7 +17,12 @@
 
 #include <string>
 #include <list>
+#include <vector>
+#include <map>
+
+#include <stdint.h>
 #include <netinet/ip6.h>
+#include <linux/netlink.h>
 
 #include "ndppd.h"
 
@@ -50,6 +55,8 @@ public:
 
     struct in6_addr& mask();
 
+    const struct in6_addr& const_mask() const;
+
     // Compare _a/_m against a._a.
     bool operator==(const address& addr) const;
 
@@ -73,20 +80,52 @@ public:
 
     operator std::string() const;
     
+    // Records that the local address 'addr' is assigned to 'ifname'.
     static void add(const address& addr, const std::string& ifname);
     
     static void load(const std::string& path);
-    
-    static std::list<ptr<route> >::iterator addresses_begin();
-    
-    static std::list<ptr<route> >::iterator addresses_end();
+
+    // Starts keeping the local addresses up to date with an RTM_GETADDR
+    // dump and RTNLGRP_IPV6_IFADDR notifications. Returns false if that
+    // can't be done, in which case update() keeps reloading
+    // /proc/net/if_inet6.
+    static bool watch();
+
+    // Returns true if 'addr' is assigned to one of our interfaces.
+    static bool is_local(const address& addr);
+
+    // Returns the names of the interfaces 'addr' is assigned to, or NULL
+    // if it isn't a local address.
+    static const std::vector<std::string>* local_ifnames(const address& addr);
+
+    // Returns the addresses assigned to the interface 'ifname', or NULL if
+    // there are none.
+    static const std::vector<address>* local_addresses(const std::string& ifname);
 
 private:
+    // A set of local addresses, indexed both by address and by interface.
+    struct table;
+
     static int _ttl;
 
     static int _c_ttl;
     
-    static std::list<ptr<route> > _addresses;
+    static table _local;
+
+    // Whether the addresses are kept up to date through netlink.
+    static bool _netlink;
+
+    // Whether a dump is in progress, and the addresses it has returned so
+    // far. They replace _local once the dump is complete.
+    static bool _dumping;
+
+    static table _dump;
+
+    static void resync();
+
+    static void handle_dump(uint32_t seq, int error, void* data);
+
+    static void handle_rtnl(const struct nlmsghdr* nlh);
     
     struct in6_addr _addr, _mask;
 };
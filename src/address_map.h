@@ -0,0 +1,328 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+#include <stdint.h>
+#include <netinet/ip6.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// An open-addressing (linear probing) hash table keyed by a full 128-bit
+// IPv6 address. Keys live inline in the bucket array next to their hash,
+// so a probe sequence touches as few cache lines as possible.
+//
+// The load factor is kept below 3/4. When the table has to grow, the
+// entries are moved to the new bucket array a few at a time on every
+// insert() and remove(), rather than all at once, so that growing a large
+// table never stalls the caller.
+
+template <typename T>
+class address_map {
+public:
+    address_map() :
+        _old(NULL), _old_cap(0), _cursor(0), _size(0)
+    {
+        _cur = new table(16);
+    }
+
+    ~address_map()
+    {
+        delete _cur;
+        delete _old;
+    }
+
+    // Returns the value stored for 'addr', or NULL if there is none.
+    T* find(const address& addr) const
+    {
+        const struct in6_addr& key = addr.const_addr();
+        uint32_t h = hash(key);
+
+        T* value = _cur->find(key, h);
+
+        if (!value && _old)
+            value = _old->find(key, h);
+
+        return value;
+    }
+
+    // Stores 'value' for 'addr', replacing any previous value. Returns
+    // true if 'addr' wasn't already in the table.
+    bool insert(const address& addr, const T& value)
+    {
+        const struct in6_addr& key = addr.const_addr();
+        uint32_t h = hash(key);
+
+        migrate();
+
+        T* v;
+
+        if ((v = _cur->find(key, h))) {
+            *v = value;
+            return false;
+        }
+
+        if (_old && (v = _old->find(key, h))) {
+            *v = value;
+            return false;
+        }
+
+        if ((_cur->used + 1) * 4 > _cur->cap * 3)
+            grow();
+
+        _cur->insert(key, h, value);
+        _size++;
+
+        return true;
+    }
+
+    // Removes 'addr' from the table. Returns false if it wasn't found.
+    bool remove(const address& addr)
+    {
+        const struct in6_addr& key = addr.const_addr();
+        uint32_t h = hash(key);
+
+        migrate();
+
+        if (_cur->remove(key, h) || (_old && _old->remove(key, h))) {
+            _size--;
+            return true;
+        }
+
+        return false;
+    }
+
+    // Appends all values in the table to 'values'.
+    void values(std::vector<T>& values) const
+    {
+        _cur->get_values(values);
+
+        if (_old)
+            _old->get_values(values);
+    }
+
+    void clear()
+    {
+        delete _cur;
+        delete _old;
+
+        _cur     = new table(16);
+        _old     = NULL;
+        _old_cap = 0;
+        _cursor  = 0;
+        _size    = 0;
+    }
+
+    // Exchanges the contents of two tables, which allows a new table to be
+    // built on the side and then put in place in one go.
+    void swap(address_map& other)
+    {
+        std::swap(_cur, other._cur);
+        std::swap(_old, other._old);
+        std::swap(_old_cap, other._old_cap);
+        std::swap(_cursor, other._cursor);
+        std::swap(_size, other._size);
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    bool empty() const
+    {
+        return !_size;
+    }
+
+private:
+    enum {
+        EMPTY,
+        USED,
+        DELETED
+    };
+
+    // Number of buckets moved to the new array per insert() or remove().
+    enum { MIGRATE_STEP = 16 };
+
+    struct bucket {
+        struct in6_addr key;
+        uint32_t hash;
+        uint32_t state;
+    };
+
+    struct table {
+        std::vector<bucket> buckets;
+        std::vector<T> values;
+        size_t cap, mask;
+
+        // Number of buckets that are USED or DELETED.
+        size_t used;
+
+        table(size_t n) :
+            buckets(n), values(n), cap(n), mask(n - 1), used(0)
+        {
+        }
+
+        T* find(const struct in6_addr& key, uint32_t h)
+        {
+            for (size_t i = h & mask; ; i = (i + 1) & mask) {
+                bucket& b = buckets[i];
+
+                if (b.state == EMPTY)
+                    return NULL;
+
+                if ((b.state == USED) && (b.hash == h) &&
+                    !memcmp(&b.key, &key, sizeof(struct in6_addr)))
+                    return &values[i];
+            }
+        }
+
+        void insert(const struct in6_addr& key, uint32_t h, const T& value)
+        {
+            for (size_t i = h & mask; ; i = (i + 1) & mask) {
+                bucket& b = buckets[i];
+
+                if (b.state == USED)
+                    continue;
+
+                if (b.state == EMPTY)
+                    used++;
+
+                b.key   = key;
+                b.hash  = h;
+                b.state = USED;
+                values[i] = value;
+                return;
+            }
+        }
+
+        bool remove(const struct in6_addr& key, uint32_t h)
+        {
+            T* v = find(key, h);
+
+            if (!v)
+                return false;
+
+            size_t i = v - &values[0];
+
+            values[i] = T();
+
+            // A bucket followed by an empty one isn't part of any other
+            // probe sequence, so it can be emptied outright.
+
+            if (buckets[(i + 1) & mask].state == EMPTY) {
+                buckets[i].state = EMPTY;
+                used--;
+            } else {
+                buckets[i].state = DELETED;
+            }
+
+            return true;
+        }
+
+        void get_values(std::vector<T>& out) const
+        {
+            for (size_t i = 0; i < cap; i++) {
+                if (buckets[i].state == USED)
+                    out.push_back(values[i]);
+            }
+        }
+    };
+
+    table* _cur;
+
+    // The table we're moving entries out of, or NULL.
+    table* _old;
+
+    size_t _old_cap;
+
+    // Next bucket of _old to move.
+    size_t _cursor;
+
+    size_t _size;
+
+    // Mixes the four words of the address into a 32-bit hash.
+    static uint32_t hash(const struct in6_addr& key)
+    {
+        uint64_t a, b;
+
+        memcpy(&a, &key.s6_addr[0], 8);
+        memcpy(&b, &key.s6_addr[8], 8);
+
+        uint64_t h = a ^ (b * 0x9e3779b97f4a7c15ULL);
+
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+
+        return (uint32_t)h;
+    }
+
+    void grow()
+    {
+        // Finish a previous resize before starting another one.
+        while (_old)
+            migrate();
+
+        // Deleted buckets count against the load factor, so if most of
+        // the used buckets are deleted a same-sized table is enough.
+
+        size_t cap = (_size * 2 >= _cur->cap) ? (_cur->cap * 2) : _cur->cap;
+
+        _old     = _cur;
+        _old_cap = _cur->cap;
+        _cursor  = 0;
+        _cur     = new table(cap);
+    }
+
+    void migrate()
+    {
+        if (!_old)
+            return;
+
+        for (size_t n = 0; (n < MIGRATE_STEP) && (_cursor < _old_cap); n++, _cursor++) {
+            bucket& b = _old->buckets[_cursor];
+
+            if (b.state != USED)
+                continue;
+
+            _cur->insert(b.key, b.hash, _old->values[_cursor]);
+
+            // Leave a tombstone so that lookups that are still probing
+            // the old table don't stop short.
+            b.state = DELETED;
+            _old->values[_cursor] = T();
+        }
+
+        if (_cursor >= _old_cap) {
+            delete _old;
+            _old = NULL;
+        }
+    }
+
+    address_map(const address_map&);
+
+    address_map& operator=(const address_map&);
+};
+
+NDPPD_NS_END
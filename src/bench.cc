@@ -0,0 +1,643 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// ndppd-bench replays the solicits and adverts of a capture (or a
+// synthetic load) through the same code that handles them in the daemon,
+// with interfaces that have no sockets and with everything that would be
+// sent captured instead. It reports the time taken and the allocations
+// made by each stage, so that changes and configurations can be compared
+// without a network.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <new>
+
+#include <getopt.h>
+#include <time.h>
+
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <net/ethernet.h>
+#include <arpa/inet.h>
+
+#include "ndppd.h"
+
+using namespace ndppd;
+
+// Allocations made through operator new, which is what the containers
+// and ptr<> use.
+
+static uint64_t allocs, alloc_bytes;
+
+void* operator new(size_t size)
+{
+    allocs++;
+    alloc_bytes += size;
+
+    void* p = malloc(size ? size : 1);
+
+    if (!p)
+        throw std::bad_alloc();
+
+    return p;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* p) throw()
+{
+    free(p);
+}
+
+void operator delete[](void* p) throw()
+{
+    free(p);
+}
+
+// What the interfaces would have sent.
+
+static uint64_t sent, sent_bytes;
+
+static int capture(int fd, struct mmsghdr* msgs, unsigned int len)
+{
+    for (unsigned int i = 0; i < len; i++) {
+        sent++;
+        sent_bytes += msgs[i].msg_hdr.msg_iov[0].iov_len;
+    }
+
+    return len;
+}
+
+static uint64_t clock_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// A solicit or advert to replay, and the interface to feed it to.
+
+struct frame {
+    std::vector<uint8_t> data;
+
+    bool solicit;
+
+    ptr<iface> ifa;
+
+    // Source and target address, taken from the frame up front.
+    struct in6_addr saddr, taddr;
+};
+
+static const size_t ICMP_OFFSET = sizeof(struct ether_header) + sizeof(struct ip6_hdr);
+
+// Keeps the frame if it's a solicit or an advert, which is all we read.
+static bool add_frame(const uint8_t* data, size_t len, std::vector<frame>& frames)
+{
+    if (len < ICMP_OFFSET + sizeof(struct nd_neighbor_solicit))
+        return false;
+
+    const struct ether_header* eh = (const struct ether_header* )data;
+    const struct ip6_hdr* ip6h    = (const struct ip6_hdr* )(data + sizeof(struct ether_header));
+    const struct icmp6_hdr* icmp  = (const struct icmp6_hdr* )(data + ICMP_OFFSET);
+
+    if ((ntohs(eh->ether_type) != ETHERTYPE_IPV6) || (ip6h->ip6_nxt != IPPROTO_ICMPV6))
+        return false;
+
+    if ((icmp->icmp6_type != ND_NEIGHBOR_SOLICIT) && (icmp->icmp6_type != ND_NEIGHBOR_ADVERT))
+        return false;
+
+    frame f;
+    f.data.assign(data, data + len);
+    f.solicit = (icmp->icmp6_type == ND_NEIGHBOR_SOLICIT);
+    f.saddr   = ip6h->ip6_src;
+    f.taddr   = ((const struct nd_neighbor_solicit* )icmp)->nd_ns_target;
+
+    frames.push_back(f);
+
+    return true;
+}
+
+static uint32_t swap32(uint32_t v, bool swap)
+{
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+// Reads the solicits and adverts of a pcap file with Ethernet frames.
+static bool load_pcap(const std::string& path, std::vector<frame>& frames)
+{
+    std::ifstream ifs(path.c_str(), std::ios::in | std::ios::binary);
+
+    uint32_t hdr[6];
+
+    if (!ifs.read((char* )hdr, sizeof(hdr))) {
+        fprintf(stderr, "Failed to read '%s'\n", path.c_str());
+        return false;
+    }
+
+    bool swap;
+
+    if ((hdr[0] == 0xa1b2c3d4) || (hdr[0] == 0xa1b23c4d)) {
+        swap = false;
+    } else if ((hdr[0] == 0xd4c3b2a1) || (hdr[0] == 0x4d3cb2a1)) {
+        swap = true;
+    } else {
+        fprintf(stderr, "'%s' is not a pcap file\n", path.c_str());
+        return false;
+    }
+
+    if (swap32(hdr[5], swap) != 1) {
+        fprintf(stderr, "'%s' doesn't hold Ethernet frames\n", path.c_str());
+        return false;
+    }
+
+    uint32_t rec[4];
+    std::vector<uint8_t> buf;
+    unsigned int skipped = 0;
+
+    while (ifs.read((char* )rec, sizeof(rec))) {
+        uint32_t len = swap32(rec[2], swap);
+
+        if (len > 65536) {
+            fprintf(stderr, "'%s' is corrupt\n", path.c_str());
+            return false;
+        }
+
+        buf.resize(len);
+
+        if (len && !ifs.read((char* )&buf[0], len))
+            break;
+
+        if (!add_frame(&buf[0], len, frames))
+            skipped++;
+    }
+
+    if (skipped)
+        fprintf(stderr, "Skipped %u frames that aren't solicits or adverts\n", skipped);
+
+    return true;
+}
+
+static uint64_t xorshift(uint64_t& state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// Builds 'count' solicits for 'targets' different addresses within the
+// rules of 'pr', each followed by an advert from the daughter interface
+// the first time it's asked for. The same arguments always give the same
+// frames.
+static void generate(const ptr<proxy>& pr, int count, int targets, std::vector<frame>& frames)
+{
+    std::vector<ptr<rule> > rules(pr->rules_begin(), pr->rules_end());
+
+    if (rules.empty() || (targets < 1))
+        return;
+
+    std::vector<struct in6_addr> pool(targets);
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+
+    for (int i = 0; i < targets; i++) {
+        const address& ru = rules[i % rules.size()]->addr();
+        struct in6_addr& a = pool[i];
+
+        for (int b = 0; b < 16; b++) {
+            int keep = ru.prefix() - b * 8;
+            uint8_t mask = (keep >= 8) ? 0xff : ((keep <= 0) ? 0 : (uint8_t)(0xff << (8 - keep)));
+
+            a.s6_addr[b] = (ru.const_addr().s6_addr[b] & mask) | ((uint8_t)xorshift(state) & ~mask);
+        }
+    }
+
+    std::vector<bool> seen(targets, false);
+
+    uint8_t data[ICMP_OFFSET + sizeof(struct nd_neighbor_advert) + 8];
+
+    for (int n = 0; n < count; n++) {
+        int t = (int)(xorshift(state) % targets);
+
+        memset(data, 0, sizeof(data));
+
+        struct ether_header* eh = (struct ether_header* )data;
+        struct ip6_hdr* ip6h    = (struct ip6_hdr* )(data + sizeof(struct ether_header));
+        struct nd_neighbor_solicit* ns = (struct nd_neighbor_solicit* )(data + ICMP_OFFSET);
+
+        static const uint8_t src[ETH_ALEN] = { 0x02, 0, 0, 0, 0, 0x01 };
+
+        memcpy(eh->ether_shost, src, ETH_ALEN);
+        eh->ether_type = htons(ETHERTYPE_IPV6);
+
+        ip6h->ip6_flow = htonl(6 << 28);
+        ip6h->ip6_plen = htons(sizeof(struct nd_neighbor_solicit) + 8);
+        ip6h->ip6_nxt  = IPPROTO_ICMPV6;
+        ip6h->ip6_hlim = 255;
+        inet_pton(AF_INET6, "2001:db8:ffff::1", &ip6h->ip6_src);
+        inet_pton(AF_INET6, "ff02::1:ff00:0", &ip6h->ip6_dst);
+        memcpy(&ip6h->ip6_dst.s6_addr[13], &pool[t].s6_addr[13], 3);
+
+        ns->nd_ns_type   = ND_NEIGHBOR_SOLICIT;
+        ns->nd_ns_target = pool[t];
+
+        uint8_t* opt = data + ICMP_OFFSET + sizeof(struct nd_neighbor_solicit);
+        opt[0] = ND_OPT_SOURCE_LINKADDR;
+        opt[1] = 1;
+        memcpy(opt + 2, src, ETH_ALEN);
+
+        add_frame(data, ICMP_OFFSET + sizeof(struct nd_neighbor_solicit) + 8, frames);
+
+        if (seen[t])
+            continue;
+
+        seen[t] = true;
+
+        // The advert the daughter interface answers with.
+
+        struct nd_neighbor_advert* na = (struct nd_neighbor_advert* )(data + ICMP_OFFSET);
+
+        ip6h->ip6_plen = htons(sizeof(struct nd_neighbor_advert) + 8);
+        ip6h->ip6_src  = pool[t];
+        inet_pton(AF_INET6, "fe80::1", &ip6h->ip6_dst);
+
+        na->nd_na_type           = ND_NEIGHBOR_ADVERT;
+        na->nd_na_flags_reserved = ND_NA_FLAG_SOLICITED;
+        na->nd_na_target         = pool[t];
+
+        opt[0] = ND_OPT_TARGET_LINKADDR;
+
+        add_frame(data, ICMP_OFFSET + sizeof(struct nd_neighbor_advert) + 8, frames);
+    }
+}
+
+// Returns the detached interface 'name', opening it if needed.
+static ptr<iface> detached(const std::string& name, struct ether_addr& hwaddr)
+{
+    std::map<std::string, weak_ptr<iface> >::iterator it = iface::_map.find(name);
+
+    if (it != iface::_map.end())
+        return it->second;
+
+    hwaddr.ether_addr_octet[5]++;
+
+    return iface::open_detached(name, hwaddr);
+}
+
+// Sets up the proxies and rules of the configuration, with detached
+// interfaces. Rules that need the routing table ('auto') are left out.
+static bool configure(const ptr<conf>& cf)
+{
+    struct ether_addr hwaddr = { { 0x02, 0, 0, 0, 0, 0 } };
+    ptr<conf> x_cf;
+
+    std::vector<ptr<conf> > proxies(cf->find_all("proxy"));
+
+    for (std::vector<ptr<conf> >::iterator p_it = proxies.begin(); p_it != proxies.end(); p_it++) {
+        ptr<conf> pr_cf = *p_it;
+
+        ptr<iface> ifa = detached(*pr_cf, hwaddr);
+
+        ptr<proxy> pr = proxy::create(ifa, false);
+
+        if ((x_cf = pr_cf->find("router")))
+            pr->router(*x_cf);
+
+        if ((x_cf = pr_cf->find("keepalive")))
+            pr->keepalive(*x_cf);
+
+        if ((x_cf = pr_cf->find("retries")))
+            pr->retries(*x_cf);
+
+        if ((x_cf = pr_cf->find("ttl")))
+            pr->ttl(*x_cf);
+
+        pr->deadtime(pr->ttl());
+
+        if ((x_cf = pr_cf->find("deadtime")))
+            pr->deadtime(*x_cf);
+
+        if ((x_cf = pr_cf->find("timeout")))
+            pr->timeout(*x_cf);
+
+        std::vector<ptr<conf> > rules(pr_cf->find_all("rule"));
+
+        for (std::vector<ptr<conf> >::iterator r_it = rules.begin(); r_it != rules.end(); r_it++) {
+            ptr<conf> ru_cf = *r_it;
+
+            address addr(*ru_cf);
+
+            if ((x_cf = ru_cf->find("iface"))) {
+                ptr<iface> daughter = detached(*x_cf, hwaddr);
+
+                daughter->add_parent(pr);
+
+                bool autovia = false;
+
+                if ((x_cf = ru_cf->find("autovia")))
+                    autovia = *x_cf;
+
+                pr->add_rule(addr, daughter, autovia);
+            } else if (ru_cf->find("auto")) {
+                fprintf(stderr, "Leaving out 'auto' rule %s, which needs the routing table\n",
+                        addr.to_string().c_str());
+            } else {
+                pr->add_rule(addr, false);
+            }
+        }
+    }
+
+    return true;
+}
+
+// Decides which interface each frame is fed to: solicits go to the
+// listening interface 'ifa', and adverts to the daughter interface of
+// the rule for their target.
+static void assign(const ptr<iface>& ifa, const ptr<proxy>& pr, std::vector<frame>& frames)
+{
+    unsigned int skipped = 0;
+
+    for (std::vector<frame>::iterator it = frames.begin(); it != frames.end(); ) {
+        if (it->solicit) {
+            (it++)->ifa = ifa;
+            continue;
+        }
+
+        std::vector<ptr<rule> > rules;
+        pr->find_rules(it->taddr, rules);
+
+        for (std::vector<ptr<rule> >::iterator r_it = rules.begin(); r_it != rules.end(); r_it++) {
+            if ((*r_it)->daughter()) {
+                it->ifa = (*r_it)->daughter();
+                break;
+            }
+        }
+
+        if (it->ifa.is_null()) {
+            it = frames.erase(it);
+            skipped++;
+        } else {
+            it++;
+        }
+    }
+
+    if (skipped)
+        fprintf(stderr, "Skipped %u adverts that no daughter interface expects\n", skipped);
+}
+
+struct stage {
+    const char* name;
+    uint64_t ns, allocs, alloc_bytes, count;
+
+    stage(const char* n) :
+        name(n), ns(0), allocs(0), alloc_bytes(0), count(0)
+    {
+    }
+};
+
+// Measures what happens between its construction and stop().
+class meter {
+public:
+    meter(stage& s) :
+        _s(s), _allocs(allocs), _alloc_bytes(alloc_bytes), _t(clock_ns())
+    {
+    }
+
+    void stop(uint64_t count)
+    {
+        _s.ns          += clock_ns() - _t;
+        _s.allocs      += allocs - _allocs;
+        _s.alloc_bytes += alloc_bytes - _alloc_bytes;
+        _s.count       += count;
+    }
+
+private:
+    stage& _s;
+    uint64_t _allocs, _alloc_bytes, _t;
+};
+
+static void report(const stage& s)
+{
+    double per = s.count ? (double)s.ns / s.count : 0;
+
+    printf("%-10s %12llu %10.1f %14.0f %10.2f %12.1f\n", s.name,
+           (unsigned long long)s.count, per, per ? 1e9 / per : 0,
+           s.count ? (double)s.allocs / s.count : 0,
+           s.count ? (double)s.alloc_bytes / s.count : 0);
+}
+
+static void usage()
+{
+    fprintf(stderr,
+        "Usage: ndppd-bench -c <config-file> [-i <interface>] [-r <rounds>] [-v]\n"
+        "                   (<pcap-file> | -n <solicits> [-t <targets>])\n");
+}
+
+int main(int argc, char* argv[])
+{
+    std::string config_path, ifname;
+    int rounds = 1, count = 0, targets = 0;
+
+    logger::verbosity(LOG_WARNING);
+
+    int c;
+
+    while ((c = getopt(argc, argv, "c:i:r:n:t:v")) != -1) {
+        switch (c) {
+        case 'c':
+            config_path = optarg;
+            break;
+
+        case 'i':
+            ifname = optarg;
+            break;
+
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+
+        case 'n':
+            count = atoi(optarg);
+            break;
+
+        case 't':
+            targets = atoi(optarg);
+            break;
+
+        case 'v':
+            logger::verbosity(logger::verbosity() + 1);
+            break;
+
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (config_path.empty() || ((optind < argc) == (count > 0)) || (rounds < 1)) {
+        usage();
+        return 1;
+    }
+
+    ptr<conf> cf = conf::load(config_path);
+
+    if (!cf || !configure(cf))
+        return 1;
+
+    // Solicits are fed to the proxy on the given interface, or the first.
+
+    ptr<proxy> pr;
+
+    for (std::map<std::string, weak_ptr<iface> >::iterator i_it = iface::_map.begin();
+            !pr && (i_it != iface::_map.end()); i_it++) {
+        ptr<iface> ifa = i_it->second;
+
+        if (!ifname.empty() && (ifa->name() != ifname))
+            continue;
+
+        for (std::list<weak_ptr<proxy> >::iterator pit = ifa->serves_begin(); pit != ifa->serves_end(); pit++) {
+            if (!(*pit).is_null()) {
+                pr = *pit;
+                break;
+            }
+        }
+    }
+
+    if (!pr) {
+        fprintf(stderr, "No proxy to feed solicits to\n");
+        return 1;
+    }
+
+    std::vector<frame> frames;
+
+    if (count > 0) {
+        generate(pr, count, (targets > 0) ? targets : ((count + 9) / 10), frames);
+    } else if (!load_pcap(argv[optind], frames)) {
+        return 1;
+    }
+
+    assign(pr->ifa(), pr, frames);
+
+    if (frames.empty()) {
+        fprintf(stderr, "Nothing to replay\n");
+        return 1;
+    }
+
+    iface::sender(capture);
+
+    stage parse("parse"), match("match"), handle("handle"), timers("timers"), flush("flush");
+
+    for (int r = 0; r < rounds; r++) {
+        // Parsing alone.
+
+        meter m(parse);
+
+        for (std::vector<frame>::iterator it = frames.begin(); it != frames.end(); it++) {
+            address saddr, daddr, taddr;
+            struct ether_addr lladdr;
+
+            if (it->solicit) {
+                it->ifa->read_solicit(&it->data[0], it->data.size(), saddr, daddr, taddr, lladdr);
+            } else {
+                it->ifa->read_advert(&it->data[ICMP_OFFSET], it->data.size() - ICMP_OFFSET,
+                                     it->saddr, saddr, taddr);
+            }
+        }
+
+        m.stop(frames.size());
+
+        // Rule lookups alone.
+
+        meter mm(match);
+        std::vector<ptr<rule> > rules;
+
+        for (std::vector<frame>::iterator it = frames.begin(); it != frames.end(); it++) {
+            rules.clear();
+            pr->find_rules(it->taddr, rules);
+        }
+
+        mm.stop(frames.size());
+
+        // Everything, in batches the way the event loop would go through
+        // them: handle the frames, then the timers, then send.
+
+        for (size_t i = 0; i < frames.size(); i += IFACE_BATCH_SIZE) {
+            size_t end = (i + IFACE_BATCH_SIZE < frames.size()) ? (i + IFACE_BATCH_SIZE) : frames.size();
+
+            meter mh(handle);
+
+            uint64_t stamp = loop::stamp();
+
+            for (size_t f = i; f < end; f++) {
+                frame& fr = frames[f];
+
+                if (fr.solicit) {
+                    fr.ifa->handle_solicit(&fr.data[0], fr.data.size(), stamp);
+                } else {
+                    fr.ifa->handle_advert(&fr.data[ICMP_OFFSET], fr.data.size() - ICMP_OFFSET, fr.saddr);
+                }
+            }
+
+            mh.stop(end - i);
+
+            meter mt(timers);
+            session::update_all();
+            mt.stop(end - i);
+
+            meter mf(flush);
+            iface::flush_all();
+            mf.stop(end - i);
+        }
+    }
+
+    size_t solicits = 0;
+
+    for (std::vector<frame>::iterator it = frames.begin(); it != frames.end(); it++) {
+        if (it->solicit)
+            solicits++;
+    }
+
+    printf("%zu frames (%zu solicits), %d round(s)\n\n", frames.size(), solicits, rounds);
+
+    printf("%-10s %12s %10s %14s %10s %12s\n", "stage", "frames", "ns/frame", "frames/s", "allocs", "bytes");
+
+    report(parse);
+    report(match);
+    report(handle);
+    report(timers);
+    report(flush);
+
+    stage total("total");
+    total.ns          = handle.ns + timers.ns + flush.ns;
+    total.allocs      = handle.allocs + timers.allocs + flush.allocs;
+    total.alloc_bytes = handle.alloc_bytes + timers.alloc_bytes + flush.alloc_bytes;
+    total.count       = handle.count;
+
+    report(total);
+
+    printf("\nCaptured %llu messages (%llu bytes)\n", (unsigned long long)sent, (unsigned long long)sent_bytes);
+
+    return 0;
+}
@@ -0,0 +1,475 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include "ndppd.h"
+#include "control.h"
+#include "route.h"
+
+NDPPD_NS_BEGIN
+
+int control::_fd = -1;
+
+std::string control::_path;
+
+std::map<int, control::client> control::_clients;
+
+bool control::open(const std::string& path)
+{
+    struct sockaddr_un sun;
+
+    if (path.size() >= sizeof(sun.sun_path)) {
+        logger::error() << "Control socket path '" << path << "' is too long";
+        return false;
+    }
+
+    if ((_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        logger::error() << "Unable to create control socket: " << logger::err();
+        return false;
+    }
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path.c_str());
+
+    unlink(path.c_str());
+
+    if (bind(_fd, (struct sockaddr* )&sun, sizeof(sun)) < 0) {
+        logger::error() << "Failed to bind control socket to '" << path << "': " << logger::err();
+        ::close(_fd);
+        _fd = -1;
+        return false;
+    }
+
+    _path = path;
+
+    // Whoever can connect can change the rules.
+    chmod(path.c_str(), 0600);
+
+    if ((listen(_fd, 8) < 0) || !loop::add(_fd, handle_accept, NULL)) {
+        logger::error() << "Failed to listen on control socket '" << path << "': " << logger::err();
+        close();
+        return false;
+    }
+
+    logger::debug() << "control::open() path=" << path;
+
+    return true;
+}
+
+void control::close()
+{
+    while (!_clients.empty())
+        disconnect(_clients.begin()->first);
+
+    if (_fd >= 0) {
+        loop::remove(_fd);
+        ::close(_fd);
+        _fd = -1;
+    }
+
+    if (!_path.empty()) {
+        unlink(_path.c_str());
+        _path.clear();
+    }
+}
+
+void control::handle_accept(int fd, uint32_t events, void* data)
+{
+    int cfd;
+
+    while ((cfd = accept4(_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        if (!loop::add(cfd, handle_client, NULL)) {
+            ::close(cfd);
+            continue;
+        }
+
+        _clients[cfd] = client();
+
+        logger::debug() << "control::handle_accept() fd=" << cfd;
+    }
+}
+
+void control::disconnect(int fd)
+{
+    logger::debug() << "control::disconnect() fd=" << fd;
+
+    loop::remove(fd);
+    ::close(fd);
+    _clients.erase(fd);
+}
+
+void control::handle_client(int fd, uint32_t events, void* data)
+{
+    std::map<int, client>::iterator it = _clients.find(fd);
+
+    if (it == _clients.end())
+        return;
+
+    client& cl = it->second;
+
+    if (events & EPOLLIN) {
+        char buf[4096];
+        ssize_t len;
+
+        while ((len = recv(fd, buf, sizeof(buf), 0)) > 0)
+            cl.in.append(buf, len);
+
+        if ((len < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+            disconnect(fd);
+            return;
+        }
+
+        if (len == 0)
+            cl.eof = true;
+
+        std::string::size_type pos;
+
+        while ((pos = cl.in.find('\n')) != std::string::npos) {
+            std::string line = cl.in.substr(0, pos);
+            cl.in.erase(0, pos + 1);
+
+            if (!line.empty() && (line[line.size() - 1] == '\r'))
+                line.erase(line.size() - 1);
+
+            std::vector<std::string> out;
+            std::string error = execute(line, out);
+
+            for (std::vector<std::string>::iterator o_it = out.begin(); o_it != out.end(); o_it++)
+                cl.out += *o_it + "\n";
+
+            cl.out += error.empty() ? "OK\n" : ("ERROR " + error + "\n");
+        }
+
+        if (cl.in.size() > CONTROL_MAX_LINE) {
+            logger::warning() << "Control client sent an overlong line; disconnecting";
+            disconnect(fd);
+            return;
+        }
+    } else if (events & (EPOLLHUP | EPOLLERR)) {
+        disconnect(fd);
+        return;
+    }
+
+    // Write as much of the output as the socket takes, and wait for it
+    // to drain if that's not all of it.
+
+    bool pending = !cl.out.empty();
+
+    while (!cl.out.empty()) {
+        ssize_t len = send(fd, cl.out.data(), cl.out.size(), MSG_NOSIGNAL);
+
+        if (len < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                break;
+
+            disconnect(fd);
+            return;
+        }
+
+        cl.out.erase(0, len);
+    }
+
+    if (cl.eof && cl.out.empty()) {
+        disconnect(fd);
+        return;
+    }
+
+    if (pending || (events & EPOLLOUT) || cl.eof)
+        loop::modify(fd, (cl.eof ? 0 : EPOLLIN) | (cl.out.empty() ? 0 : EPOLLOUT));
+}
+
+std::string control::execute(const std::string& line, std::vector<std::string>& out)
+{
+    std::istringstream is(line);
+    std::vector<std::string> args;
+    std::string arg;
+
+    while (is >> arg)
+        args.push_back(arg);
+
+    if (args.empty())
+        return "no command";
+
+    logger::debug() << "control::execute() " << line;
+
+    if (args[0] == "sessions")
+        return cmd_sessions(args, out);
+
+    if (args[0] == "stats") {
+        stats(out);
+        return "";
+    }
+
+    if (args[0] == "flush")
+        return cmd_flush(args, out);
+
+    if (args[0] == "probe")
+        return cmd_probe(args, out);
+
+    if (args[0] == "rule")
+        return cmd_rule(args, out);
+
+    return "unknown command '" + args[0] + "'";
+}
+
+// Returns the proxies, in order, of the interface named 'ifname', or of
+// all interfaces if it's empty.
+static void find_proxies(const std::string& ifname, std::vector<ptr<proxy> >& proxies)
+{
+    for (std::map<std::string, weak_ptr<iface> >::iterator i_it = iface::_map.begin(); i_it != iface::_map.end(); i_it++) {
+        ptr<iface> ifa = i_it->second;
+
+        if (!ifa || (!ifname.empty() && (ifa->name() != ifname)))
+            continue;
+
+        for (std::list<weak_ptr<proxy> >::iterator pit = ifa->serves_begin(); pit != ifa->serves_end(); pit++) {
+            ptr<proxy> pr = (*pit);
+
+            if (pr)
+                proxies.push_back(pr);
+        }
+    }
+}
+
+static const char* status_name(int status)
+{
+    switch (status) {
+    case session::WAITING:
+        return "waiting";
+    case session::RENEWING:
+        return "renewing";
+    case session::VALID:
+        return "valid";
+    case session::INVALID:
+        return "invalid";
+    default:
+        return "unknown";
+    }
+}
+
+std::string control::cmd_sessions(const std::vector<std::string>& args, std::vector<std::string>& out)
+{
+    std::vector<ptr<proxy> > proxies;
+    find_proxies("", proxies);
+
+    for (std::vector<ptr<proxy> >::iterator pit = proxies.begin(); pit != proxies.end(); pit++) {
+        std::vector<ptr<session> > sessions;
+        (*pit)->sessions(sessions);
+
+        for (std::vector<ptr<session> >::iterator it = sessions.begin(); it != sessions.end(); it++) {
+            ptr<session> se = *it;
+
+            out.push_back(
+                (*pit)->ifa()->name() + " " + se->taddr().to_string() + " " + status_name(se->status()) +
+                logger::format(" ttl=%d fails=%d wired=", se->ttl(), se->fails()) +
+                (se->wired_ifname().empty() ? "-" : se->wired_ifname()));
+        }
+    }
+
+    return "";
+}
+
+void control::stats(std::vector<std::string>& lines)
+{
+    for (std::map<std::string, weak_ptr<iface> >::iterator i_it = iface::_map.begin(); i_it != iface::_map.end(); i_it++) {
+        ptr<iface> ifa = i_it->second;
+
+        if (!ifa)
+            continue;
+
+        ifa->update_drops();
+
+        lines.push_back("iface " + ifa->name() + " " + ifa->stats().to_string());
+
+        for (std::list<weak_ptr<proxy> >::iterator pit = ifa->serves_begin(); pit != ifa->serves_end(); pit++) {
+            ptr<proxy> pr = (*pit);
+            if (!pr) continue;
+
+            lines.push_back("proxy " + ifa->name() + " " + pr->stats().to_string());
+
+            for (int i = 0; i < 2; i++) {
+                const histogram& h = i ? pr->discovery_latency() : pr->hit_latency();
+
+                lines.push_back(
+                    "latency " + ifa->name() + (i ? " discovery" : " hit") +
+                    logger::format(" count=%llu p50=%lluus p90=%lluus p99=%lluus p999=%lluus max=%lluus",
+                        (unsigned long long)h.count(),
+                        (unsigned long long)(h.quantile(0.5) / 1000), (unsigned long long)(h.quantile(0.9) / 1000),
+                        (unsigned long long)(h.quantile(0.99) / 1000), (unsigned long long)(h.quantile(0.999) / 1000),
+                        (unsigned long long)(h.max() / 1000)));
+            }
+
+            for (std::list<ptr<rule> >::iterator rit = pr->rules_begin(); rit != pr->rules_end(); rit++)
+                lines.push_back("rule " + ifa->name() + " " + (*rit)->addr().to_string() + " " + (*rit)->stats().to_string());
+        }
+    }
+}
+
+std::string control::cmd_flush(const std::vector<std::string>& args, std::vector<std::string>& out)
+{
+    address prefix;
+
+    if ((args.size() != 2) || !prefix.parse_string(args[1]))
+        return "usage: flush <prefix>";
+
+    std::vector<ptr<proxy> > proxies;
+    find_proxies("", proxies);
+
+    int count = 0;
+
+    for (std::vector<ptr<proxy> >::iterator pit = proxies.begin(); pit != proxies.end(); pit++)
+        count += (*pit)->flush_sessions(prefix);
+
+    out.push_back(logger::format("flushed %d", count));
+
+    return "";
+}
+
+std::string control::cmd_probe(const std::vector<std::string>& args, std::vector<std::string>& out)
+{
+    address prefix;
+
+    if ((args.size() != 2) || !prefix.parse_string(args[1]))
+        return "usage: probe <prefix>";
+
+    std::vector<ptr<proxy> > proxies;
+    find_proxies("", proxies);
+
+    int count = 0;
+
+    for (std::vector<ptr<proxy> >::iterator pit = proxies.begin(); pit != proxies.end(); pit++) {
+        ptr<proxy> pr = *pit;
+
+        // A single target gets a session if a rule allows for one, so
+        // that it can be probed before anyone has asked for it.
+
+        if (prefix.prefix() == 128)
+            pr->find_or_create_session(prefix);
+
+        std::vector<ptr<session> > sessions;
+        pr->sessions(sessions);
+
+        for (std::vector<ptr<session> >::iterator it = sessions.begin(); it != sessions.end(); it++) {
+            if (prefix == (*it)->taddr()) {
+                (*it)->probe();
+                count++;
+            }
+        }
+    }
+
+    out.push_back(logger::format("probed %d", count));
+
+    return "";
+}
+
+std::string control::cmd_rule(const std::vector<std::string>& args, std::vector<std::string>& out)
+{
+    static const std::string usage =
+        "usage: rule add <proxy> <prefix> [static | auto | iface <name> [autovia]] | rule del <proxy> <prefix>";
+
+    // Every worker has rules and a filter of its own, so changing them in
+    // just this one would apply the rule to only some of the targets.
+    if (iface::workers() > 1)
+        return "rules can't be changed with more than one worker";
+
+    address addr;
+
+    if ((args.size() < 4) || !addr.parse_string(args[3]))
+        return usage;
+
+    std::vector<ptr<proxy> > proxies;
+    find_proxies(args[2], proxies);
+
+    if (proxies.empty())
+        return "no proxy on interface '" + args[2] + "'";
+
+    ptr<proxy> pr = proxies.front();
+
+    if (args[1] == "del") {
+        if (args.size() != 4)
+            return usage;
+
+        if (!pr->remove_rule(addr))
+            return "no rule for " + addr.to_string();
+    } else if (args[1] == "add") {
+        std::vector<ptr<rule> > rules;
+        pr->find_rules(addr, rules);
+
+        for (std::vector<ptr<rule> >::iterator it = rules.begin(); it != rules.end(); it++) {
+            if ((*it)->addr().prefix() == addr.prefix())
+                return "there's already a rule for " + addr.to_string();
+        }
+
+        // Routes and local addresses are only watched if some rule needs
+        // them, so start watching them if this is the first such rule.
+
+        bool local_addresses = rule::any_iface() || iface::any_xdp() || proxy::any_raw_advert();
+
+        if ((args.size() == 4) || ((args.size() == 5) && (args[4] == "static"))) {
+            pr->add_rule(addr, false);
+        } else if ((args.size() == 5) && (args[4] == "auto")) {
+            if (!rule::any_auto())
+                route::watch();
+
+            pr->add_rule(addr, true);
+        } else if ((args.size() >= 6) && (args.size() <= 7) && (args[4] == "iface")) {
+            bool autovia = false;
+
+            if (args.size() == 7) {
+                if (args[6] != "autovia")
+                    return usage;
+
+                autovia = true;
+            }
+
+            ptr<iface> ifa = iface::open_ifd(args[5]);
+
+            if (!ifa)
+                return "unable to open interface '" + args[5] + "'";
+
+            ifa->add_parent(pr);
+
+            pr->add_rule(addr, ifa, autovia);
+
+            if (!local_addresses)
+                address::watch();
+        } else {
+            return usage;
+        }
+    } else {
+        return usage;
+    }
+
+    // New or removed rules change what we listen for.
+    iface::update_filters();
+
+    return "";
+}
+
+NDPPD_NS_END
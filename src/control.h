@@ -0,0 +1,99 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <stdint.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// Maximum length of a command line on the control socket.
+#define CONTROL_MAX_LINE 1024
+
+// A UNIX-domain socket, served from the event loop, through which the
+// daemon can be queried and told what to do while it's running. The
+// protocol is line based; every command is answered with zero or more
+// lines of output followed by a line that's either "OK" or "ERROR"
+// and a message. The commands are:
+//
+//   sessions                     Lists the sessions of all proxies.
+//   stats                        Lists the counters of all interfaces,
+//                                proxies and rules.
+//   flush <prefix>               Removes the sessions within 'prefix'.
+//   probe <prefix>               Solicits the targets of the sessions
+//                                within 'prefix' again right away.
+//   rule add <proxy> <prefix> [static | auto | iface <name> [autovia]]
+//   rule del <proxy> <prefix>    Adds or removes a rule of the proxy on
+//                                the interface <proxy>. Not available
+//                                with more than one worker.
+
+class control {
+public:
+    // Starts listening on 'path', replacing any socket left there.
+    static bool open(const std::string& path);
+
+    // Stops listening, disconnects all clients and removes the socket.
+    static void close();
+
+    // Appends a line for the counters of every interface, proxy and rule.
+    static void stats(std::vector<std::string>& lines);
+
+private:
+    struct client {
+        std::string in, out;
+
+        // Set once the client has shut down its end; we hang up as soon
+        // as the output has been written.
+        bool eof;
+
+        client() :
+            eof(false)
+        {
+        }
+    };
+
+    static int _fd;
+
+    static std::string _path;
+
+    // Connected clients by descriptor.
+    static std::map<int, client> _clients;
+
+    static void handle_accept(int fd, uint32_t events, void* data);
+
+    static void handle_client(int fd, uint32_t events, void* data);
+
+    static void disconnect(int fd);
+
+    // Runs the command 'line', appending its output to 'out'. Returns an
+    // empty string on success, otherwise what went wrong.
+    static std::string execute(const std::string& line, std::vector<std::string>& out);
+
+    static std::string cmd_sessions(const std::vector<std::string>& args, std::vector<std::string>& out);
+
+    static std::string cmd_flush(const std::vector<std::string>& args, std::vector<std::string>& out);
+
+    static std::string cmd_probe(const std::vector<std::string>& args, std::vector<std::string>& out);
+
+    static std::string cmd_rule(const std::vector<std::string>& args, std::vector<std::string>& out);
+};
+
+NDPPD_NS_END
@@ -0,0 +1,93 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <new>
+#include <cstdlib>
+#include <string>
+
+#include <stdint.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// Packet and session counters kept by interfaces, proxies and rules.
+// Everything runs on a single thread, so they're bumped with plain
+// increments. Each set is allocated on cache lines of its own, so that
+// the counters of one object never share a line with those of another,
+// or with the fields that are read on the same paths.
+
+struct counters {
+    // Solicits and adverts received and sent.
+    uint64_t ns_rx, ns_tx, na_rx, na_tx;
+
+    // Solicits sent again because the previous ones went unanswered.
+    uint64_t retries;
+
+    // Messages that were malformed, or that nobody had a use for.
+    uint64_t ignored;
+
+    // Sessions created, sessions that expired after having been valid,
+    // and sessions whose target never answered.
+    uint64_t sessions_created, sessions_expired, sessions_invalid;
+
+    // Frames that the kernel dropped because we didn't read them in time.
+    uint64_t drops;
+
+    // Routes added and removed by autowire, and requests that failed.
+    uint64_t routes_added, routes_removed, route_errors;
+
+    // Returns the counters as space-separated name=value pairs.
+    std::string to_string() const
+    {
+        return logger::format(
+            "ns_rx=%llu ns_tx=%llu na_rx=%llu na_tx=%llu retries=%llu ignored=%llu "
+            "sessions_created=%llu sessions_expired=%llu sessions_invalid=%llu drops=%llu "
+            "routes_added=%llu routes_removed=%llu route_errors=%llu",
+            (unsigned long long)ns_rx, (unsigned long long)ns_tx,
+            (unsigned long long)na_rx, (unsigned long long)na_tx,
+            (unsigned long long)retries, (unsigned long long)ignored,
+            (unsigned long long)sessions_created, (unsigned long long)sessions_expired,
+            (unsigned long long)sessions_invalid, (unsigned long long)drops,
+            (unsigned long long)routes_added, (unsigned long long)routes_removed,
+            (unsigned long long)route_errors);
+    }
+
+    counters() :
+        ns_rx(0), ns_tx(0), na_rx(0), na_tx(0), retries(0), ignored(0),
+        sessions_created(0), sessions_expired(0), sessions_invalid(0), drops(0),
+        routes_added(0), routes_removed(0), route_errors(0)
+    {
+    }
+
+    static void* operator new(size_t size)
+    {
+        void* p;
+
+        if (posix_memalign(&p, 64, size))
+            throw std::bad_alloc();
+
+        return p;
+    }
+
+    static void operator delete(void* p)
+    {
+        free(p);
+    }
+} __attribute__((aligned(64)));
+
+NDPPD_NS_END
@@ -0,0 +1,137 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <cstring>
+
+#include <stdint.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// A log-linear histogram in the style of HdrHistogram. Values below 16
+// get a bucket each; above that, every power of two is split into 16
+// equally wide buckets, so a value is off by at most 1/16 (about 6%) of
+// itself once it's been recorded. Recording is a couple of shifts and
+// an increment, which is cheap enough for the packet path.
+
+class histogram {
+public:
+    // Number of linear sub-buckets per power of two, as a power of two.
+    enum { SUB_BITS = 4, SUB_COUNT = 1 << SUB_BITS };
+
+    // Values of 2^MAX_BITS and above end up in the last bucket.
+    enum { MAX_BITS = 40 };
+
+    enum { BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_COUNT };
+
+    histogram()
+    {
+        reset();
+    }
+
+    void record(uint64_t value)
+    {
+        _buckets[index(value)]++;
+        _count++;
+        _sum += value;
+
+        if (value > _max)
+            _max = value;
+    }
+
+    // Returns the smallest value that at least 'q' (0 to 1) of the
+    // recorded values are below or equal to, give or take the width of
+    // its bucket, or 0 if nothing has been recorded.
+    uint64_t quantile(double q) const
+    {
+        if (!_count)
+            return 0;
+
+        uint64_t rank = (uint64_t)(q * _count + 0.5);
+
+        if (rank < 1)
+            rank = 1;
+
+        uint64_t seen = 0;
+
+        for (int i = 0; i < BUCKETS; i++) {
+            if ((seen += _buckets[i]) >= rank) {
+                uint64_t high = upper(i);
+                return (high < _max) ? high : _max;
+            }
+        }
+
+        return _max;
+    }
+
+    uint64_t count() const
+    {
+        return _count;
+    }
+
+    uint64_t sum() const
+    {
+        return _sum;
+    }
+
+    uint64_t max() const
+    {
+        return _max;
+    }
+
+    void reset()
+    {
+        memset(_buckets, 0, sizeof(_buckets));
+        _count = _sum = _max = 0;
+    }
+
+private:
+    uint64_t _buckets[BUCKETS];
+
+    uint64_t _count, _sum, _max;
+
+    static int index(uint64_t value)
+    {
+        if (value < SUB_COUNT)
+            return (int)value;
+
+        if (value >> MAX_BITS)
+            return BUCKETS - 1;
+
+        // The position of the highest bit picks the power of two, and the
+        // SUB_BITS bits below it the bucket within it.
+
+        int exp = 63 - __builtin_clzll(value);
+
+        return (exp - SUB_BITS + 1) * SUB_COUNT + (int)((value >> (exp - SUB_BITS)) & (SUB_COUNT - 1));
+    }
+
+    // Returns the largest value that falls in bucket 'i'.
+    static uint64_t upper(int i)
+    {
+        if (i < SUB_COUNT)
+            return i;
+
+        int exp = i / SUB_COUNT + SUB_BITS - 1;
+        uint64_t sub = SUB_COUNT + (i % SUB_COUNT);
+
+        return ((sub + 1) << (exp - SUB_BITS)) - 1;
+    }
+};
+
+NDPPD_NS_END
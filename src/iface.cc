@@ -24,20 +24,24 @@
 #include <netinet/ip6.h>
 #include <netinet/icmp6.h>
 #include <netinet/ether.h>
-#include <netpacket/packet.h>
 
 #include <net/if.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 
 #include <linux/filter.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_packet.h>
 
 #include <errno.h>
 #include <string>
+#include <fstream>
 #include <vector>
 #include <map>
+#include <set>
 
 #include "ndppd.h"
 #include "route.h"
@@ -46,12 +50,88 @@ NDPPD_NS_BEGIN
 
 std::map<std::string, weak_ptr<iface> > iface::_map;
 
-bool iface::_map_dirty = false;
+int iface::_budget = 256;
 
-std::vector<struct pollfd> iface::_pollfds;
+int iface::_workers = 1;
+
+int iface::_worker = 0;
+
+int iface::_fanout_id = 0;
+
+static int default_send(int fd, struct mmsghdr* msgs, unsigned int len)
+{
+    return sendmmsg(fd, msgs, len, 0);
+}
+
+iface::send_fn iface::_send = default_send;
+
+// Reusable buffer for the messages that iface::read_batch() fetches with
+// recvmmsg(). Everything runs in the same thread, so one is enough.
+
+static struct {
+    struct mmsghdr hdr[IFACE_BATCH_SIZE];
+    struct iovec iov[IFACE_BATCH_SIZE];
+    struct sockaddr_storage saddr[IFACE_BATCH_SIZE];
+    uint8_t msg[IFACE_BATCH_SIZE][256];
+    uint8_t cmsg[IFACE_BATCH_SIZE][CMSG_SPACE(sizeof(struct timespec))];
+} _batch;
+
+// Returns the time message 'i' of the batch buffer was received, from
+// its SO_TIMESTAMPNS control message, or now if it doesn't have one.
+static uint64_t batch_stamp(int i)
+{
+    struct msghdr* mh = &_batch.hdr[i].msg_hdr;
+
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(mh); cm; cm = CMSG_NXTHDR(mh, cm)) {
+        if ((cm->cmsg_level == SOL_SOCKET) && (cm->cmsg_type == SCM_TIMESTAMPNS)) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+            return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        }
+    }
+
+    return loop::stamp();
+}
+
+std::list<weak_ptr<iface> > iface::_flushq;
+
+// Headers for the messages that iface::flush() sends with sendmmsg().
+
+static struct {
+    struct mmsghdr hdr[IFACE_TXQ_SIZE];
+    struct iovec iov[IFACE_TXQ_SIZE];
+} _tx_batch;
+
+static int read_sysctl(const std::string& path)
+{
+    std::ifstream ifs(path.c_str());
+    int val;
+
+    if (!(ifs >> val)) {
+        logger::error() << "Failed to read " << path;
+        return -1;
+    }
+
+    return val;
+}
+
+static bool write_sysctl(const std::string& path, int val)
+{
+    std::ofstream ofs(path.c_str());
+
+    if (!(ofs << val << std::endl)) {
+        logger::error() << "Failed to write " << path;
+        return false;
+    }
+
+    return true;
+}
 
 iface::iface() :
-    _ifd(-1), _pfd(-1), _name("")
+    _ifd(-1), _pfd(-1), _ring(NULL), _xsk_drops(0), _stats(new counters()), _txq(IFACE_TXQ_SIZE), _txq_len(0),
+    _rawq(IFACE_TXQ_SIZE), _rawq_len(0),
+    _prev_allmulti(-1), _prev_promiscuous(-1), _solicited_node(false), _prev_proxy_ndp(-1), _prev_proxy_delay(-1), _name(""),
+    _hwaddr_gen(0)
 {
 }
 
@@ -59,8 +139,11 @@ iface::~iface()
 {
     logger::debug() << "iface::~iface()";
 
-    if (_ifd >= 0)
+    if (_ifd >= 0) {
+        flush();
+        loop::remove(_ifd);
         close(_ifd);
+    }
 
     if (_pfd >= 0) {
         if (_prev_allmulti >= 0) {
@@ -69,16 +152,57 @@ iface::~iface()
         if (_prev_promiscuous >= 0) {
             promiscuous(_prev_promiscuous);
         }
+        if (_ring) {
+            munmap(_ring, _ring_block_nr * _ring_block_size);
+        }
+        loop::remove(_pfd);
         close(_pfd);
     }
 
-    _map_dirty = true;
+    if (_prev_proxy_ndp >= 0) {
+        write_sysctl("/proc/sys/net/ipv6/conf/" + _name + "/proxy_ndp", _prev_proxy_ndp);
+    }
+
+    if (_prev_proxy_delay >= 0) {
+        write_sysctl("/proc/sys/net/ipv6/neigh/" + _name + "/proxy_delay", _prev_proxy_delay);
+    }
+
+    // Our entry in the map no longer points anywhere, so drop it.
+    std::map<std::string, weak_ptr<iface> >::iterator it = _map.find(_name);
+
+    if ((it != _map.end()) && it->second.is_null())
+        _map.erase(it);
     
     _serves.clear();
     _parents.clear();
+
+    delete _stats;
+}
+
+ptr<iface> iface::open_detached(const std::string& name, const struct ether_addr& hwaddr)
+{
+    if (_map.find(name) != _map.end()) {
+        logger::error() << "Interface '" << name << "' is already open";
+        return ptr<iface>();
+    }
+
+    ptr<iface> ifa(new iface());
+    ifa->_name = name;
+    ifa->_ptr  = ifa;
+
+    _map[name] = ifa;
+
+    ifa->set_hwaddr((const uint8_t* )&hwaddr);
+
+    return ifa;
+}
+
+void iface::sender(send_fn fn)
+{
+    _send = fn;
 }
 
-ptr<iface> iface::open_pfd(const std::string& name, bool promiscuous)
+ptr<iface> iface::open_pfd(const std::string& name, bool promiscuous, bool ring, bool solicited_node)
 {
     int fd = 0;
 
@@ -136,57 +260,567 @@ ptr<iface> iface::open_pfd(const std::string& name, bool promiscuous)
         return ptr<iface>();
     }
 
-    // Set up filter.
+    // Have the kernel tell us when each solicit arrived, so that we
+    // know how long it took us to answer.
+
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+        logger::warning() << "Failed to turn on timestamps on interface '" << name << "'";
+    }
+
+    // Set up an instance of 'iface'.
+
+    ifa->_pfd = fd;
+
+    // Set up filter. It's narrowed down to the targets of our rules by
+    // update_filter() once they have been configured.
+
+    if (!ifa->update_filter()) {
+        ifa->_pfd = -1;
+        close(fd);
+        return ptr<iface>();
+    }
+
+    if (ring && !ifa->open_ring()) {
+        logger::warning() << "Failed to set up receive ring on interface '" << name << "', falling back to recvmmsg()";
+    }
+
+    if ((_workers > 1) && !ifa->join_fanout()) {
+        ifa->_pfd = -1;
+        close(fd);
+        return ptr<iface>();
+    }
+
+    // Eh. Allmulti. Unless we're asked to join the solicited-node groups
+    // instead, which update_groups() does once the rules are known.
+    // The interface settings are left to the first worker.
+    ifa->_solicited_node = solicited_node;
+
+    if (solicited_node || _worker) {
+        ifa->_prev_allmulti = -1;
+    } else {
+        ifa->_prev_allmulti = ifa->allmulti(1);
+    }
+    
+    // Eh. Promiscuous
+    if (promiscuous == true && !_worker) {
+        ifa->_prev_promiscuous = ifa->promiscuous(1);
+    } else {
+        ifa->_prev_promiscuous = -1;
+    }
 
-    static struct sock_filter filter[] = {
+    loop::add(fd, iface::handle_event, ifa.get_pointer());
+
+    return ifa;
+}
+
+// Offset of the target address of a solicit in the frames we read.
+#define FILTER_TADDR_OFFSET \
+    (sizeof(struct ether_header) + sizeof(struct ip6_hdr) + offsetof(struct nd_neighbor_solicit, nd_ns_target))
+
+static bool filter_prefix_less(const address& a, const address& b)
+{
+    return a.prefix() < b.prefix();
+}
+
+bool iface::collect_prefixes(std::vector<address>& matches)
+{
+    // Collect the prefixes we answer for, and the local addresses that
+    // handle_local() answers for. If we're a daughter of another proxy,
+    // the source of every solicit matters to handle_reverse_advert(),
+    // so we need to see them all.
+
+    if (!_parents.empty())
+        return false;
+
+    std::vector<address> prefixes;
+
+    for (std::list<weak_ptr<proxy> >::iterator pit = _serves.begin(); pit != _serves.end(); pit++) {
+        ptr<proxy> pr = *pit;
+
+        if (!pr)
+            continue;
+
+        for (std::list<ptr<rule> >::iterator it = pr->rules_begin(); it != pr->rules_end(); it++) {
+            ptr<rule> ru = *it;
+
+            prefixes.push_back(ru->addr());
+
+            if (!ru->daughter())
+                continue;
+
+            const std::vector<address>* la = address::local_addresses(ru->daughter()->name());
+
+            if (la)
+                prefixes.insert(prefixes.end(), la->begin(), la->end());
+        }
+    }
+
+    // Skip the prefixes that are covered by a shorter one.
+
+    std::stable_sort(prefixes.begin(), prefixes.end(), filter_prefix_less);
+
+    for (std::vector<address>::iterator it = prefixes.begin(); it != prefixes.end(); it++) {
+        bool covered = false;
+
+        for (std::vector<address>::iterator m = matches.begin(); !covered && (m != matches.end()); m++)
+            covered = (*m == *it);
+
+        if (covered)
+            continue;
+
+        if (!it->prefix())
+            return false;
+
+        matches.push_back(*it);
+    }
+
+    return true;
+}
+
+bool iface::update_filter()
+{
+    if (_pfd < 0)
+        return true;
+
+    std::vector<struct sock_filter> code;
+
+    // Bail unless it's an ICMPv6 solicit.
+
+    struct sock_filter head[] = {
         // Load the ether_type.
         BPF_STMT(BPF_LD | BPF_H | BPF_ABS,
             offsetof(struct ether_header, ether_type)),
-        // Bail if it's* not* ETHERTYPE_IPV6.
-        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IPV6, 0, 5),
+        // Drop if it's* not* ETHERTYPE_IPV6.
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IPV6, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0),
         // Load the next header type.
         BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
             sizeof(struct ether_header) + offsetof(struct ip6_hdr, ip6_nxt)),
-        // Bail if it's* not* IPPROTO_ICMPV6.
-        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMPV6, 0, 3),
+        // Drop if it's* not* IPPROTO_ICMPV6.
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMPV6, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0),
         // Load the ICMPv6 type.
         BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
             sizeof(struct ether_header) + sizeof(ip6_hdr) + offsetof(struct icmp6_hdr, icmp6_type)),
-        // Bail if it's* not* ND_NEIGHBOR_SOLICIT.
-        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ND_NEIGHBOR_SOLICIT, 0, 1),
-        // Keep packet.
-        BPF_STMT(BPF_RET | BPF_K, (u_int32_t)-1),
-        // Drop packet.
+        // Drop if it's* not* ND_NEIGHBOR_SOLICIT.
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ND_NEIGHBOR_SOLICIT, 1, 0),
         BPF_STMT(BPF_RET | BPF_K, 0)
     };
 
-    static struct sock_fprog fprog = {
-        8,
-        filter
+    code.assign(head, head + sizeof(head) / sizeof(head[0]));
+
+    std::vector<address> matches;
+
+    bool all = !collect_prefixes(matches);
+
+    // Compare the target address one word at a time against each prefix,
+    // moving on to the next prefix as soon as a word doesn't match.
+
+    for (std::vector<address>::iterator it = matches.begin(); !all && (it != matches.end()); it++) {
+        int words = (it->prefix() + 31) / 32;
+
+        // ld, (and), jeq per word, plus the final ret.
+        int left = 1;
+
+        for (int w = 0; w < words; w++)
+            left += (ntohl(it->const_mask().s6_addr32[w]) != 0xffffffff) ? 3 : 2;
+
+        for (int w = 0; w < words; w++) {
+            uint32_t mask = ntohl(it->const_mask().s6_addr32[w]);
+            uint32_t val  = ntohl(it->const_addr().s6_addr32[w]) & mask;
+
+            code.push_back((struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(FILTER_TADDR_OFFSET + w * 4)));
+            left--;
+
+            if (mask != 0xffffffff) {
+                code.push_back((struct sock_filter)BPF_STMT(BPF_ALU | BPF_AND | BPF_K, mask));
+                left--;
+            }
+
+            left--;
+            code.push_back((struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, val, 0, (uint8_t)left));
+        }
+
+        // Keep packet.
+        code.push_back((struct sock_filter)BPF_STMT(BPF_RET | BPF_K, (u_int32_t)-1));
+
+        if (code.size() >= BPF_MAXINSNS) {
+            logger::warning() << "Too many rules to filter solicits on interface '" << _name << "' in the kernel";
+            all = true;
+        }
+    }
+
+    if (!all) {
+        // Drop packet.
+        code.push_back((struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0));
+
+        struct sock_fprog fprog;
+
+        fprog.len    = code.size();
+        fprog.filter = &code[0];
+
+        if (setsockopt(_pfd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
+            logger::warning() << "Failed to filter solicits on interface '" << _name
+                << "' in the kernel: " << logger::err();
+            all = true;
+        }
+    }
+
+    if (all) {
+        code.resize(sizeof(head) / sizeof(head[0]));
+        // Keep packet.
+        code.push_back((struct sock_filter)BPF_STMT(BPF_RET | BPF_K, (u_int32_t)-1));
+
+        struct sock_fprog fprog;
+
+        fprog.len    = code.size();
+        fprog.filter = &code[0];
+
+        if (setsockopt(_pfd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
+            logger::error() << "Failed to set filter: " << logger::err();
+            return false;
+        }
+    }
+
+    logger::debug()
+        << "iface::update_filter() _name=\"" << _name << "\", prefixes="
+        << (all ? 0 : matches.size()) << ", insns=" << code.size();
+
+    // The XDP program only takes the solicits that we're sure to handle,
+    // and never the ones for our own addresses since the kernel needs
+    // those. If we need to see all solicits, it takes none.
+
+    if (_xdp) {
+        const std::vector<address>* la = address::local_addresses(_name);
+
+        if (all)
+            matches.clear();
+
+        _xdp->update(matches, la ? *la : std::vector<address>());
+    }
+
+    return true;
+}
+
+bool iface::membership(int op, uint32_t group)
+{
+    // The solicited-node group ff02::1:ffXX:XXXX maps to 33:33:ff:XX:XX:XX.
+
+    struct packet_mreq mreq;
+
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = if_nametoindex(_name.c_str());
+    mreq.mr_type    = PACKET_MR_MULTICAST;
+    mreq.mr_alen    = ETH_ALEN;
+
+    mreq.mr_address[0] = 0x33;
+    mreq.mr_address[1] = 0x33;
+    mreq.mr_address[2] = 0xff;
+    mreq.mr_address[3] = (group >> 16) & 0xff;
+    mreq.mr_address[4] = (group >> 8) & 0xff;
+    mreq.mr_address[5] = group & 0xff;
+
+    if (setsockopt(_pfd, SOL_PACKET, op, &mreq, sizeof(mreq)) < 0) {
+        logger::error() << "Failed to " << ((op == PACKET_ADD_MEMBERSHIP) ? "join" : "leave")
+            << " multicast group on interface '" << _name << "': " << logger::err();
+        return false;
+    }
+
+    return true;
+}
+
+bool iface::update_groups()
+{
+    if ((_pfd < 0) || !_solicited_node || _worker)
+        return true;
+
+    // Work out which solicited-node groups the targets we answer for can
+    // be in. Prefixes that span more than IFACE_MAX_GROUPS groups, or
+    // that we can't narrow down at all, need ALLMULTI instead.
+
+    std::vector<address> prefixes;
+
+    bool all = !collect_prefixes(prefixes);
+
+    std::set<uint32_t> groups;
+
+    for (std::vector<address>::iterator it = prefixes.begin(); !all && (it != prefixes.end()); it++) {
+        if (it->prefix() < 128 - 24) {
+            all = true;
+            break;
+        }
+
+        uint32_t base  = ntohl(it->const_addr().s6_addr32[3]) & 0xffffff;
+        uint32_t count = 1U << (128 - it->prefix());
+
+        base &= ~(count - 1);
+
+        if (groups.size() + count > IFACE_MAX_GROUPS) {
+            all = true;
+            break;
+        }
+
+        for (uint32_t i = 0; i < count; i++)
+            groups.insert(base | i);
+    }
+
+    if (all)
+        groups.clear();
+
+    // Leave the groups we no longer need, and join the new ones.
+
+    for (std::set<uint32_t>::iterator it = _groups.begin(); it != _groups.end(); ) {
+        if (groups.find(*it) == groups.end()) {
+            membership(PACKET_DROP_MEMBERSHIP, *it);
+            _groups.erase(it++);
+        } else {
+            it++;
+        }
+    }
+
+    for (std::set<uint32_t>::iterator it = groups.begin(); it != groups.end(); it++) {
+        if ((_groups.find(*it) == _groups.end()) && membership(PACKET_ADD_MEMBERSHIP, *it))
+            _groups.insert(*it);
+    }
+
+    if (all && (_prev_allmulti < 0)) {
+        _prev_allmulti = allmulti(1);
+    } else if (!all && (_prev_allmulti >= 0)) {
+        allmulti(_prev_allmulti);
+        _prev_allmulti = -1;
+    }
+
+    logger::debug()
+        << "iface::update_groups() _name=\"" << _name << "\", groups="
+        << _groups.size() << ", allmulti=" << (all ? "yes" : "no");
+
+    return true;
+}
+
+bool iface::open_xdp()
+{
+    if (_xdp)
+        return true;
+
+    ptr<xdp> xd = xdp::open(_name);
+
+    if (!xd)
+        return false;
+
+    const std::vector<ptr<xsk> >& sockets = xd->sockets();
+
+    for (std::vector<ptr<xsk> >::const_iterator it = sockets.begin(); it != sockets.end(); it++) {
+        if (!loop::add((*it)->fd(), iface::handle_event, this))
+            return false;
+    }
+
+    _xdp = xd;
+
+    // Nothing is redirected until we've told the program which prefixes
+    // to look for.
+    update_filter();
+
+    return true;
+}
+
+bool iface::any_xdp()
+{
+    for (std::map<std::string, weak_ptr<iface> >::iterator it = _map.begin(); it != _map.end(); it++) {
+        ptr<iface> ifa = it->second;
+
+        if (ifa && ifa->_xdp)
+            return true;
+    }
+
+    return false;
+}
+
+int iface::read_xsk(const ptr<xsk>& xs, int budget)
+{
+    int n = xs->receive(budget);
+
+    if (n <= 0)
+        return 0;
+
+    logger::debug() << "iface::read_xsk() ifa=" << _name << ", queue=" << xs->queue()
+                    << ", count=" << n;
+
+    // Frames redirected by XDP don't carry a timestamp, but we read
+    // them right away.
+    uint64_t stamp = loop::stamp();
+
+    for (int i = 0; i < n; i++) {
+        size_t len;
+        const uint8_t* msg = xs->frame(i, len);
+        handle_solicit(msg, len, stamp);
+    }
+
+    xs->release(n);
+
+    return n;
+}
+
+void iface::update_filters()
+{
+    for (std::map<std::string, weak_ptr<iface> >::iterator it = _map.begin(); it != _map.end(); it++) {
+        ptr<iface> ifa = it->second;
+
+        if (ifa) {
+            ifa->update_filter();
+            ifa->update_groups();
+        }
+    }
+}
+
+void iface::workers(int count)
+{
+    _workers = count;
+
+    // The fanout group of each interface is its index plus this.
+    _fanout_id = getpid();
+}
+
+int iface::workers()
+{
+    return _workers;
+}
+
+void iface::worker(int index)
+{
+    _worker = index;
+}
+
+int iface::worker()
+{
+    return _worker;
+}
+
+bool iface::join_fanout()
+{
+    // Hand each solicit to the worker picked by the last word of the
+    // target address; the kernel takes it modulo the number of sockets
+    // in the group. All solicits for a target go to the same worker, so
+    // each one sees a disjoint set of sessions.
+    //
+    // Unlike the socket filter, this program runs before the link-layer
+    // header is pushed back, so offsets start at the IPv6 header.
+
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+            (uint32_t)(FILTER_TADDR_OFFSET - sizeof(struct ether_header) + 12)),
+        BPF_STMT(BPF_RET | BPF_A, 0)
     };
 
-    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
-        logger::error() << "Failed to set filter";
-        return ptr<iface>();
+    struct sock_fprog fprog;
+
+    fprog.len    = sizeof(code) / sizeof(code[0]);
+    fprog.filter = code;
+
+    int arg = ((_fanout_id + if_nametoindex(_name.c_str())) & 0xffff) | (PACKET_FANOUT_CBPF << 16);
+
+    if (setsockopt(_pfd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0) {
+        logger::error() << "Failed to join fanout group on interface '" << _name << "': " << logger::err();
+        return false;
     }
 
-    // Set up an instance of 'iface'.
+    if (setsockopt(_pfd, SOL_PACKET, PACKET_FANOUT_DATA, &fprog, sizeof(fprog)) < 0) {
+        logger::error() << "Failed to set fanout filter on interface '" << _name << "': " << logger::err();
+        return false;
+    }
 
-    ifa->_pfd = fd;
+    logger::debug() << "iface::join_fanout() _name=\"" << _name << "\", worker=" << _worker;
 
-    // Eh. Allmulti.
-    ifa->_prev_allmulti = ifa->allmulti(1);
-    
-    // Eh. Promiscuous
-    if (promiscuous == true) {
-        ifa->_prev_promiscuous = ifa->promiscuous(1);
-    } else {
-        ifa->_prev_promiscuous = -1;
+    return true;
+}
+
+bool iface::open_ring()
+{
+    int version = TPACKET_V3;
+
+    if (setsockopt(_pfd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        logger::error() << "iface::open_ring() failed PACKET_VERSION: " << logger::err();
+        return false;
     }
 
-    _map_dirty = true;
+    // Solicits are tiny, so a handful of small blocks is plenty. Blocks are
+    // handed over once full, or once they've been open for a millisecond.
 
-    return ifa;
+    struct tpacket_req3 req;
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size     = getpagesize() << 2;
+    req.tp_block_nr       = 64;
+    req.tp_frame_size     = TPACKET_ALIGNMENT << 7;
+    req.tp_frame_nr       = (req.tp_block_size * req.tp_block_nr) / req.tp_frame_size;
+    req.tp_retire_blk_tov = 1;
+
+    if (setsockopt(_pfd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+        logger::error() << "iface::open_ring() failed PACKET_RX_RING: " << logger::err();
+        return false;
+    }
+
+    void* ring = mmap(NULL, req.tp_block_size * req.tp_block_nr, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, _pfd, 0);
+
+    if (ring == MAP_FAILED) {
+        logger::error() << "iface::open_ring() failed mmap: " << logger::err();
+
+        // Tear the ring down again so that recvmmsg() gets the packets.
+        memset(&req, 0, sizeof(req));
+        setsockopt(_pfd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req));
+        return false;
+    }
+
+    _ring            = (uint8_t* )ring;
+    _ring_block_nr   = req.tp_block_nr;
+    _ring_block_size = req.tp_block_size;
+    _ring_block      = 0;
+
+    logger::debug() << "iface::open_ring() ifa=" << _name << ", blocks=" << _ring_block_nr
+                    << ", block_size=" << _ring_block_size;
+
+    return true;
+}
+
+int iface::read_ring(int budget)
+{
+    int count = 0;
+
+    while (count < budget) {
+        struct tpacket_block_desc* bd =
+            (struct tpacket_block_desc* )(_ring + _ring_block * _ring_block_size);
+
+        if (!(bd->hdr.bh1.block_status & TP_STATUS_USER)) {
+            break;
+        }
+
+        __sync_synchronize();
+
+        unsigned int num_pkts = bd->hdr.bh1.num_pkts;
+
+        struct tpacket3_hdr* ppd =
+            (struct tpacket3_hdr* )((uint8_t* )bd + bd->hdr.bh1.offset_to_first_pkt);
+
+        logger::debug() << "iface::read_ring() ifa=" << _name << ", block=" << _ring_block
+                        << ", count=" << num_pkts;
+
+        for (unsigned int i = 0; i < num_pkts; i++) {
+            handle_solicit((uint8_t* )ppd + ppd->tp_mac, ppd->tp_snaplen,
+                           (uint64_t)ppd->tp_sec * 1000000000 + ppd->tp_nsec);
+            ppd = (struct tpacket3_hdr* )((uint8_t* )ppd + ppd->tp_next_offset);
+        }
+
+        count += num_pkts;
+
+        // Hand the block back to the kernel.
+
+        __sync_synchronize();
+        bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+
+        _ring_block = (_ring_block + 1) % _ring_block_nr;
+    }
+
+    return count;
 }
 
 ptr<iface> iface::open_ifd(const std::string& name)
@@ -294,89 +928,162 @@ ptr<iface> iface::open_ifd(const std::string& name)
 
     ifa->_ifd = fd;
 
-    memcpy(&ifa->hwaddr, ifr.ifr_hwaddr.sa_data, sizeof(struct ether_addr));
+    ifa->set_hwaddr((const uint8_t* )ifr.ifr_hwaddr.sa_data);
 
-    _map_dirty = true;
+    loop::add(fd, iface::handle_event, ifa.get_pointer());
 
     return ifa;
 }
 
-ssize_t iface::read(int fd, struct sockaddr* saddr, ssize_t saddr_size, uint8_t* msg, size_t size)
+int iface::read_batch(int fd, int count)
 {
-    struct msghdr mhdr;
-    struct iovec iov;
+    if (count > IFACE_BATCH_SIZE)
+        count = IFACE_BATCH_SIZE;
+
+    for (int i = 0; i < count; i++) {
+        _batch.iov[i].iov_base = _batch.msg[i];
+        _batch.iov[i].iov_len  = sizeof(_batch.msg[i]);
+
+        memset(&_batch.hdr[i], 0, sizeof(struct mmsghdr));
+        _batch.hdr[i].msg_hdr.msg_name    = (caddr_t)&_batch.saddr[i];
+        _batch.hdr[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        _batch.hdr[i].msg_hdr.msg_iov     = &_batch.iov[i];
+        _batch.hdr[i].msg_hdr.msg_iovlen  = 1;
+        _batch.hdr[i].msg_hdr.msg_control    = _batch.cmsg[i];
+        _batch.hdr[i].msg_hdr.msg_controllen = sizeof(_batch.cmsg[i]);
+    }
+
     int len;
 
-    if (!msg || (size < 0))
+    if ((len = recvmmsg(fd, _batch.hdr, count, MSG_DONTWAIT, NULL)) < 0) {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            return 0;
+
+        logger::error() << "iface::read_batch() failed! error=" << logger::err() << ", ifa=" << name();
         return -1;
+    }
 
-    iov.iov_len = size;
-    iov.iov_base = (caddr_t)msg;
+    logger::debug() << "iface::read_batch() ifa=" << name() << ", count=" << len;
 
-    memset(&mhdr, 0, sizeof(mhdr));
-    mhdr.msg_name = (caddr_t)saddr;
-    mhdr.msg_namelen = saddr_size;
-    mhdr.msg_iov =& iov;
-    mhdr.msg_iovlen = 1;
-    
-    if ((len = recvmsg(fd,& mhdr, 0)) < 0)
-    {
-        logger::error() << "iface::read() failed! error=" << logger::err() << ", ifa=" << name();
+    return len;
+}
+
+ssize_t iface::write(const address& daddr, const uint8_t* msg, size_t size)
+{
+    if (size > sizeof(_txq[0].msg))
         return -1;
-    }
-    
-    logger::debug() << "iface::read() ifa=" << name() << ", len=" << len;
 
-    if (len < sizeof(struct icmp6_hdr))
-        return -1;
+    if (_txq_len >= _txq.size())
+        flush();
+
+    txq_entry& e = _txq[_txq_len];
+
+    memset(&e.daddr, 0, sizeof(struct sockaddr_in6));
+    e.daddr.sin6_family = AF_INET6;
+    e.daddr.sin6_port   = htons(IPPROTO_ICMPV6); // Needed?
+    memcpy(&e.daddr.sin6_addr,& daddr.const_addr(), sizeof(struct in6_addr));
+
+    memcpy(e.msg, msg, size);
+    e.size = size;
+
+    if (!_txq_len++ && !_rawq_len)
+        _flushq.push_back(_ptr);
+
+    logger::debug() << "iface::write() ifa=" << name() << ", daddr=" << daddr.to_string() << ", len="
+                    << size;
+
+    return size;
+}
+
+ssize_t iface::write_raw(const uint8_t* frame, size_t size)
+{
+    if (size > sizeof(_rawq[0].msg))
+        return -1;
+
+    if (_rawq_len >= _rawq.size())
+        flush();
+
+    txq_entry& e = _rawq[_rawq_len];
+
+    memcpy(e.msg, frame, size);
+    e.size = size;
+
+    if (!_rawq_len++ && !_txq_len)
+        _flushq.push_back(_ptr);
+
+    logger::debug() << "iface::write_raw() ifa=" << name() << ", len=" << size;
 
-    return len;
+    return size;
 }
 
-ssize_t iface::write(int fd, const address& daddr, const uint8_t* msg, size_t size)
+void iface::flush()
 {
-    struct sockaddr_in6 daddr_tmp;
-    struct msghdr mhdr;
-    struct iovec iov;
+    flush(_ifd, _txq, _txq_len, true);
+    flush(_pfd, _rawq, _rawq_len, false);
+}
 
-    memset(&daddr_tmp, 0, sizeof(struct sockaddr_in6));
-    daddr_tmp.sin6_family = AF_INET6;
-    daddr_tmp.sin6_port   = htons(IPPROTO_ICMPV6); // Needed?
-    memcpy(&daddr_tmp.sin6_addr,& daddr.const_addr(), sizeof(struct in6_addr));
+void iface::flush(int fd, std::vector<txq_entry>& q, unsigned int& len, bool named)
+{
+    if (!len)
+        return;
 
-    iov.iov_len = size;
-    iov.iov_base = (caddr_t)msg;
+    for (unsigned int i = 0; i < len; i++) {
+        _tx_batch.iov[i].iov_base = (caddr_t)q[i].msg;
+        _tx_batch.iov[i].iov_len  = q[i].size;
 
-    memset(&mhdr, 0, sizeof(mhdr));
-    mhdr.msg_name = (caddr_t)&daddr_tmp;
-    mhdr.msg_namelen = sizeof(sockaddr_in6);
-    mhdr.msg_iov =& iov;
-    mhdr.msg_iovlen = 1;
+        memset(&_tx_batch.hdr[i], 0, sizeof(struct mmsghdr));
 
-    logger::debug() << "iface::write() ifa=" << name() << ", daddr=" << daddr.to_string() << ", len="
-                    << size;
+        if (named) {
+            _tx_batch.hdr[i].msg_hdr.msg_name    = (caddr_t)&q[i].daddr;
+            _tx_batch.hdr[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+        }
 
-    int len;
+        _tx_batch.hdr[i].msg_hdr.msg_iov     = &_tx_batch.iov[i];
+        _tx_batch.hdr[i].msg_hdr.msg_iovlen  = 1;
+    }
 
-    if ((len = sendmsg(fd,& mhdr, 0)) < 0)
-    {
-        logger::error() << "iface::write() failed! error=" << logger::err() << ", ifa=" << name() << ", daddr=" << daddr.to_string();
-        return -1;
+    logger::debug() << "iface::flush() ifa=" << name() << ", fd=" << fd << ", count=" << len;
+
+    // sendmmsg() stops at the first message that fails, so report that
+    // one and carry on with the rest.
+
+    for (unsigned int i = 0; i < len; ) {
+        int n;
+
+        if ((n = _send(fd, &_tx_batch.hdr[i], len - i)) < 0) {
+            if (named) {
+                logger::error() << "iface::flush() failed! error=" << logger::err() << ", ifa=" << name()
+                                << ", daddr=" << address(q[i].daddr.sin6_addr).to_string();
+            } else {
+                logger::error() << "iface::flush() failed! error=" << logger::err() << ", ifa=" << name();
+            }
+            i++;
+            continue;
+        }
+
+        i += n;
     }
 
-    return len;
+    len = 0;
 }
 
-ssize_t iface::read_solicit(address& saddr, address& daddr, address& taddr)
+void iface::flush_all()
 {
-    struct sockaddr_ll t_saddr;
-    uint8_t msg[256];
-    ssize_t len;
+    while (!_flushq.empty()) {
+        ptr<iface> ifa = _flushq.front();
+        _flushq.pop_front();
 
-    if ((len = read(_pfd, (struct sockaddr*)&t_saddr, sizeof(struct sockaddr_ll), msg, sizeof(msg))) < 0) {
-        logger::warning() << "iface::read_solicit() failed: " << logger::err();
-        return -1;
+        if (ifa) {
+            ifa->flush();
+        }
     }
+}
+
+ssize_t iface::read_solicit(const uint8_t* msg, size_t len, address& saddr, address& daddr, address& taddr,
+                            struct ether_addr& lladdr)
+{
+    if (len < ETH_HLEN + sizeof(struct ip6_hdr) + sizeof(struct nd_neighbor_solicit))
+        return -1;
 
     struct ip6_hdr* ip6h =
           (struct ip6_hdr* )(msg + ETH_HLEN);
@@ -387,6 +1094,30 @@ ssize_t iface::read_solicit(address& saddr, address& daddr, address& taddr)
     taddr = ns->nd_ns_target;
     daddr = ip6h->ip6_dst;
     saddr = ip6h->ip6_src;
+
+    memcpy(&lladdr, ((const struct ether_header* )msg)->ether_shost, ETH_ALEN);
+
+    // Look for a source link-layer address option.
+
+    size_t end = ETH_HLEN + sizeof(struct ip6_hdr) + ntohs(ip6h->ip6_plen);
+
+    if (end > len)
+        end = len;
+
+    for (size_t off = ETH_HLEN + sizeof(struct ip6_hdr) + sizeof(struct nd_neighbor_solicit);
+            off + sizeof(struct nd_opt_hdr) <= end; ) {
+        const struct nd_opt_hdr* opt = (const struct nd_opt_hdr* )(msg + off);
+
+        if (!opt->nd_opt_len || (off + opt->nd_opt_len * 8 > end))
+            break;
+
+        if ((opt->nd_opt_type == ND_OPT_SOURCE_LINKADDR) && (opt->nd_opt_len == 1)) {
+            memcpy(&lladdr, msg + off + sizeof(struct nd_opt_hdr), ETH_ALEN);
+            break;
+        }
+
+        off += opt->nd_opt_len * 8;
+    }
     
     // Ignore packets sent from this machine
     if (iface::is_local(saddr) == true) {
@@ -401,15 +1132,21 @@ ssize_t iface::read_solicit(address& saddr, address& daddr, address& taddr)
 
 ssize_t iface::write_solicit(const address& taddr)
 {
-    char buf[128];
+    nd_template tpl;
+    return write_solicit(taddr, tpl);
+}
+
+void iface::build_solicit(const address& taddr, nd_template& tpl)
+{
+    struct nd_neighbor_solicit* ns = (struct nd_neighbor_solicit* )tpl.msg;
 
-    memset(buf, 0, sizeof(buf));
+    if (tpl.gen == _hwaddr_gen)
+        return;
 
-    struct nd_neighbor_solicit* ns =
-        (struct nd_neighbor_solicit* )&buf[0];
+    memset(tpl.msg, 0, sizeof(tpl.msg));
 
     struct nd_opt_hdr* opt =
-        (struct nd_opt_hdr* )&buf[sizeof(struct nd_neighbor_solicit)];
+        (struct nd_opt_hdr* )&tpl.msg[sizeof(struct nd_neighbor_solicit)];
 
     opt->nd_opt_type = ND_OPT_SOURCE_LINKADDR;
     opt->nd_opt_len  = 1;
@@ -418,73 +1155,283 @@ ssize_t iface::write_solicit(const address& taddr)
 
     memcpy(&ns->nd_ns_target,& taddr.const_addr(), sizeof(struct in6_addr));
 
-    memcpy(buf + sizeof(struct nd_neighbor_solicit) + sizeof(struct nd_opt_hdr),
+    memcpy(tpl.msg + sizeof(struct nd_neighbor_solicit) + sizeof(struct nd_opt_hdr),
            &hwaddr, 6);
 
-    // FIXME: Alright, I'm lazy.
-    static address multicast("ff02::1:ff00:0000");
+    // The solicited-node multicast address; ff02::1:ffXX:XXXX.
 
-    address daddr;
+    memset(&tpl.daddr, 0, sizeof(tpl.daddr));
 
-    daddr = multicast;
+    tpl.daddr.s6_addr[0]  = 0xff;
+    tpl.daddr.s6_addr[1]  = 0x02;
+    tpl.daddr.s6_addr[11] = 0x01;
+    tpl.daddr.s6_addr[12] = 0xff;
+    tpl.daddr.s6_addr[13] = taddr.const_addr().s6_addr[13];
+    tpl.daddr.s6_addr[14] = taddr.const_addr().s6_addr[14];
+    tpl.daddr.s6_addr[15] = taddr.const_addr().s6_addr[15];
 
-    daddr.addr().s6_addr[13] = taddr.const_addr().s6_addr[13];
-    daddr.addr().s6_addr[14] = taddr.const_addr().s6_addr[14];
-    daddr.addr().s6_addr[15] = taddr.const_addr().s6_addr[15];
+    tpl.gen = _hwaddr_gen;
+}
+
+ssize_t iface::write_solicit(const address& taddr, nd_template& tpl)
+{
+    build_solicit(taddr, tpl);
+
+    address daddr(tpl.daddr);
 
     logger::debug() << "iface::write_solicit() taddr=" << taddr.to_string()
                     << ", daddr=" << daddr.to_string();
 
-    return write(_ifd, daddr, (uint8_t* )buf, sizeof(struct nd_neighbor_solicit)
+    _stats->ns_tx++;
+
+    return write(daddr, tpl.msg, sizeof(struct nd_neighbor_solicit)
                  + sizeof(struct nd_opt_hdr) + 6);
 }
 
 ssize_t iface::write_advert(const address& daddr, const address& taddr, bool router)
 {
-    char buf[128];
+    nd_template tpl;
+    return write_advert(daddr, taddr, router, tpl);
+}
+
+void iface::build_advert(const address& taddr, nd_template& tpl)
+{
+    struct nd_neighbor_advert* na = (struct nd_neighbor_advert* )tpl.msg;
 
-    memset(buf, 0, sizeof(buf));
+    if (tpl.gen == _hwaddr_gen)
+        return;
 
-    struct nd_neighbor_advert* na =
-        (struct nd_neighbor_advert* )&buf[0];
+    memset(tpl.msg, 0, sizeof(tpl.msg));
 
     struct nd_opt_hdr* opt =
-        (struct nd_opt_hdr* )&buf[sizeof(struct nd_neighbor_advert)];
+        (struct nd_opt_hdr* )&tpl.msg[sizeof(struct nd_neighbor_advert)];
 
     opt->nd_opt_type         = ND_OPT_TARGET_LINKADDR;
     opt->nd_opt_len          = 1;
 
     na->nd_na_type           = ND_NEIGHBOR_ADVERT;
-    na->nd_na_flags_reserved = (daddr.is_multicast() ? 0 : ND_NA_FLAG_SOLICITED) | (router ? ND_NA_FLAG_ROUTER : 0);
 
     memcpy(&na->nd_na_target,& taddr.const_addr(), sizeof(struct in6_addr));
 
-    memcpy(buf + sizeof(struct nd_neighbor_advert) + sizeof(struct nd_opt_hdr),
+    memcpy(tpl.msg + sizeof(struct nd_neighbor_advert) + sizeof(struct nd_opt_hdr),
            &hwaddr, 6);
 
+    tpl.gen = _hwaddr_gen;
+}
+
+ssize_t iface::write_advert(const address& daddr, const address& taddr, bool router, nd_template& tpl)
+{
+    struct nd_neighbor_advert* na = (struct nd_neighbor_advert* )tpl.msg;
+
+    build_advert(taddr, tpl);
+
+    // Only the flags depend on who's asking.
+    na->nd_na_flags_reserved = (daddr.is_multicast() ? 0 : ND_NA_FLAG_SOLICITED) | (router ? ND_NA_FLAG_ROUTER : 0);
+
     logger::debug() << "iface::write_advert() daddr=" << daddr.to_string()
                     << ", taddr=" << taddr.to_string();
 
-    return write(_ifd, daddr, (uint8_t* )buf, sizeof(struct nd_neighbor_advert) +
+    _stats->na_tx++;
+
+    return write(daddr, tpl.msg, sizeof(struct nd_neighbor_advert) +
         sizeof(struct nd_opt_hdr) + 6);
 }
 
-ssize_t iface::read_advert(address& saddr, address& taddr)
+// Computes the ICMPv6 checksum of 'len' bytes at 'msg', sent from 'saddr'
+// to 'daddr'.
+static uint16_t icmp6_checksum(const struct in6_addr& saddr, const struct in6_addr& daddr,
+                               const uint8_t* msg, size_t len)
 {
-    struct sockaddr_in6 t_saddr;
-    uint8_t msg[256];
-    ssize_t len;
-    
-    memset(&t_saddr, 0, sizeof(struct sockaddr_in6));
-    t_saddr.sin6_family = AF_INET6;
-    t_saddr.sin6_port   = htons(IPPROTO_ICMPV6); // Needed?
+    uint32_t sum = 0;
 
-    if ((len = read(_ifd, (struct sockaddr* )&t_saddr, sizeof(struct sockaddr_in6), msg, sizeof(msg))) < 0) {
-        logger::warning() << "iface::read_advert() failed: " << logger::err();
-        return -1;
+    // The pseudo-header.
+
+    for (int i = 0; i < 16; i += 2) {
+        sum += (saddr.s6_addr[i] << 8) | saddr.s6_addr[i + 1];
+        sum += (daddr.s6_addr[i] << 8) | daddr.s6_addr[i + 1];
+    }
+
+    sum += len;
+    sum += IPPROTO_ICMPV6;
+
+    for (size_t i = 0; i + 1 < len; i += 2)
+        sum += (msg[i] << 8) | msg[i + 1];
+
+    if (len & 1)
+        sum += msg[len - 1] << 8;
+
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return htons(~sum & 0xffff);
+}
+
+ssize_t iface::write_raw_advert(const address& daddr, const struct ether_addr& lladdr,
+                                const address& taddr, bool router, nd_template& tpl)
+{
+    static const struct ether_addr none = { { 0 } };
+
+    // Adverts are sent from our link-local address, like the kernel
+    // would for a link-local destination.
+
+    const std::vector<address>* la = address::local_addresses(_name);
+
+    const address* saddr = NULL;
+
+    for (size_t i = 0; la && (i < la->size()); i++) {
+        const struct in6_addr& a = (*la)[i].const_addr();
+
+        if ((a.s6_addr[0] == 0xfe) && ((a.s6_addr[1] & 0xc0) == 0x80)) {
+            saddr = &(*la)[i];
+            break;
+        }
+    }
+
+    if ((_pfd < 0) || !saddr || (!daddr.is_multicast() && !memcmp(&lladdr, &none, sizeof(none))))
+        return write_advert(daddr, taddr, router, tpl);
+
+    size_t len = sizeof(struct nd_neighbor_advert) + sizeof(struct nd_opt_hdr) + 6;
+
+    struct nd_neighbor_advert* na = (struct nd_neighbor_advert* )tpl.msg;
+
+    build_advert(taddr, tpl);
+
+    uint8_t frame[sizeof(struct ether_header) + sizeof(struct ip6_hdr) + sizeof(tpl.msg)];
+
+    struct ether_header* eh = (struct ether_header* )frame;
+    struct ip6_hdr* ip6h    = (struct ip6_hdr* )(frame + sizeof(struct ether_header));
+    uint8_t* msg            = frame + sizeof(struct ether_header) + sizeof(struct ip6_hdr);
+
+    // Multicast goes to 33:33 followed by the last 32 bits of the group.
+
+    if (daddr.is_multicast()) {
+        eh->ether_dhost[0] = 0x33;
+        eh->ether_dhost[1] = 0x33;
+        memcpy(&eh->ether_dhost[2], &daddr.const_addr().s6_addr[12], 4);
+    } else {
+        memcpy(eh->ether_dhost, &lladdr, ETH_ALEN);
+    }
+
+    memcpy(eh->ether_shost, &hwaddr, ETH_ALEN);
+    eh->ether_type = htons(ETHERTYPE_IPV6);
+
+    memset(ip6h, 0, sizeof(struct ip6_hdr));
+    ip6h->ip6_flow = htonl(6 << 28);
+    ip6h->ip6_plen = htons(len);
+    ip6h->ip6_nxt  = IPPROTO_ICMPV6;
+    ip6h->ip6_hlim = 255;
+    ip6h->ip6_src  = saddr->const_addr();
+    ip6h->ip6_dst  = daddr.const_addr();
+
+    na->nd_na_flags_reserved = (daddr.is_multicast() ? 0 : ND_NA_FLAG_SOLICITED) | (router ? ND_NA_FLAG_ROUTER : 0);
+    na->nd_na_cksum = 0;
+
+    memcpy(msg, tpl.msg, len);
+
+    ((struct nd_neighbor_advert* )msg)->nd_na_cksum =
+        icmp6_checksum(ip6h->ip6_src, ip6h->ip6_dst, msg, len);
+
+    logger::debug() << "iface::write_raw_advert() daddr=" << daddr.to_string()
+                    << ", lladdr=" << ether_ntoa(&lladdr) << ", taddr=" << taddr.to_string();
+
+    _stats->na_tx++;
+
+    return write_raw(frame, sizeof(struct ether_header) + sizeof(struct ip6_hdr) + len);
+}
+
+void iface::set_hwaddr(const uint8_t* addr)
+{
+    if (_hwaddr_gen && !memcmp(&hwaddr, addr, sizeof(struct ether_addr)))
+        return;
+
+    memcpy(&hwaddr, addr, sizeof(struct ether_addr));
+
+    // Zero means "never built".
+    if (!++_hwaddr_gen)
+        _hwaddr_gen = 1;
+
+    logger::debug() << "iface::set_hwaddr() _name=\"" << _name << "\", hwaddr="
+                    << ether_ntoa(&hwaddr);
+}
+
+bool iface::watch()
+{
+    rtnl::watch(RTM_NEWLINK, iface::handle_rtnl);
+
+    if (!rtnl::subscribe(RTNLGRP_LINK, iface::resync)) {
+        logger::warning() << "Unable to monitor link-layer addresses";
+        return false;
+    }
+
+    // Catch up with changes made before we subscribed.
+    resync();
+
+    return true;
+}
+
+void iface::resync()
+{
+    for (std::map<std::string, weak_ptr<iface> >::iterator it = _map.begin(); it != _map.end(); it++) {
+        ptr<iface> ifa = it->second;
+
+        if (!ifa || (ifa->_ifd < 0))
+            continue;
+
+        struct ifreq ifr;
+
+        memset(&ifr, 0, sizeof(ifr));
+        strncpy(ifr.ifr_name, ifa->_name.c_str(), IFNAMSIZ - 1);
+
+        if (ioctl(ifa->_ifd, SIOCGIFHWADDR, &ifr) < 0) {
+            logger::error() << "Failed to detect link-layer address for interface '" << ifa->_name << "'";
+            continue;
+        }
+
+        ifa->set_hwaddr((const uint8_t* )ifr.ifr_hwaddr.sa_data);
+    }
+}
+
+void iface::handle_rtnl(const struct nlmsghdr* nlh)
+{
+    const struct ifinfomsg* ifi = (const struct ifinfomsg* )NLMSG_DATA(nlh);
+
+    int len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*ifi));
+
+    if (len < 0)
+        return;
+
+    const char* ifname = NULL;
+    const uint8_t* lladdr = NULL;
+
+    for (const struct rtattr* rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == IFLA_IFNAME) {
+            ifname = (const char* )RTA_DATA(rta);
+        } else if ((rta->rta_type == IFLA_ADDRESS) && (RTA_PAYLOAD(rta) == sizeof(struct ether_addr))) {
+            lladdr = (const uint8_t* )RTA_DATA(rta);
+        }
     }
 
-    saddr = t_saddr.sin6_addr;
+    if (!ifname || !lladdr)
+        return;
+
+    std::map<std::string, weak_ptr<iface> >::iterator it = _map.find(ifname);
+
+    if (it == _map.end())
+        return;
+
+    ptr<iface> ifa = it->second;
+
+    if (ifa)
+        ifa->set_hwaddr(lladdr);
+}
+
+ssize_t iface::read_advert(const uint8_t* msg, size_t len, const struct in6_addr& msg_saddr,
+                           address& saddr, address& taddr)
+{
+    if (len < sizeof(struct nd_neighbor_advert))
+        return -1;
+
+    saddr = msg_saddr;
     
     // Ignore packets sent from this machine
     if (iface::is_local(saddr) == true) {
@@ -494,7 +1441,7 @@ ssize_t iface::read_advert(address& saddr, address& taddr)
     if (((struct icmp6_hdr* )msg)->icmp6_type != ND_NEIGHBOR_ADVERT)
         return -1;
 
-    taddr = ((struct nd_neighbor_solicit* )msg)->nd_ns_target;
+    taddr = ((struct nd_neighbor_advert* )msg)->nd_na_target;
 
     logger::debug() << "iface::read_advert() saddr=" << saddr.to_string() << ", taddr=" << taddr.to_string() << ", len=" << len;
 
@@ -505,36 +1452,33 @@ bool iface::is_local(const address& addr)
 {
     // Check if the address is for an interface we own that is attached to
     // one of the slave interfaces    
-    for (std::list<ptr<route> >::iterator ad = address::addresses_begin(); ad != address::addresses_end(); ad++)
-    {
-        if ((*ad)->addr() == addr)
-            return true;
-    }
-    return false;
+    return address::is_local(addr);
 }
 
 bool iface::handle_local(const address& saddr, const address& taddr)
 {
     // Check if the address is for an interface we own that is attached to
     // one of the slave interfaces    
-    for (std::list<ptr<route> >::iterator ad = address::addresses_begin(); ad != address::addresses_end(); ad++)
+    const std::vector<std::string>* ifnames = address::local_ifnames(taddr);
+
+    if (!ifnames)
+        return false;
+
+    for (std::vector<std::string>::const_iterator ad = ifnames->begin(); ad != ifnames->end(); ad++)
     {
-        if ((*ad)->addr() == taddr)
-        {
-            // Loop through all the serves that are using this iface to respond to NDP solicitation requests
-            for (std::list<weak_ptr<proxy> >::iterator pit = serves_begin(); pit != serves_end(); pit++) {
-                ptr<proxy> pr = (*pit);
-                if (!pr) continue;
-                
-                for (std::list<ptr<rule> >::iterator it = pr->rules_begin(); it != pr->rules_end(); it++) {
-                    ptr<rule> ru = *it;
-
-                    if (ru->daughter() && ru->daughter()->name() == (*ad)->ifname())
-                    {
-                        logger::debug() << "proxy::handle_solicit() found local taddr=" << taddr;
-                        write_advert(saddr, taddr, false);
-                        return true;
-                    }
+        // Loop through all the serves that are using this iface to respond to NDP solicitation requests
+        for (std::list<weak_ptr<proxy> >::iterator pit = serves_begin(); pit != serves_end(); pit++) {
+            ptr<proxy> pr = (*pit);
+            if (!pr) continue;
+            
+            for (std::list<ptr<rule> >::iterator it = pr->rules_begin(); it != pr->rules_end(); it++) {
+                ptr<rule> ru = *it;
+
+                if (ru->daughter() && ru->daughter()->name() == *ad)
+                {
+                    logger::debug() << "proxy::handle_solicit() found local taddr=" << taddr;
+                    write_advert(saddr, taddr, false);
+                    return true;
                 }
             }
         }
@@ -561,10 +1505,13 @@ void iface::handle_reverse_advert(const address& saddr, const std::string& ifnam
         // Setup the reverse path on any proxies that are dealing
         // with the reverse direction (this helps improve connectivity and
         // latency in a full duplex setup)
-        for (std::list<ptr<rule> >::iterator it = parent->rules_begin(); it != parent->rules_end(); it++) {
+        std::vector<ptr<rule> > rules;
+        parent->find_rules(saddr, rules);
+
+        for (std::vector<ptr<rule> >::iterator it = rules.begin(); it != rules.end(); it++) {
             ptr<rule> ru = *it;
 
-            if (ru->addr() == saddr &&
+            if (ru->daughter() &&
                 ru->daughter()->name() == ifname)
             {
                 logger::debug() << " - generating artifical advertisement: " << ifname;
@@ -574,185 +1521,213 @@ void iface::handle_reverse_advert(const address& saddr, const std::string& ifnam
     }
 }
 
-void iface::fixup_pollfds()
+void iface::handle_solicit(const uint8_t* msg, size_t len, uint64_t stamp)
 {
-    _pollfds.resize(_map.size()*  2);
-
-    int i = 0;
-
-    logger::debug() << "iface::fixup_pollfds() _map.size()=" << _map.size();
-
-    for (std::map<std::string, weak_ptr<iface> >::iterator it = _map.begin();
-            it != _map.end(); it++) {
-        _pollfds[i].fd      = it->second->_ifd;
-        _pollfds[i].events  = POLLIN;
-        _pollfds[i].revents = 0;
-        i++;
+    address saddr, daddr, taddr;
+    struct ether_addr lladdr;
+    ssize_t size;
+
+    size = read_solicit(msg, len, saddr, daddr, taddr, lladdr);
+    if (size < 0) {
+        logger::debug() << "iface::read_solicit() malformed message on interface '" << _name << "'";
+        _stats->ignored++;
+        return;
+    }
+    if (size == 0) {
+        logger::debug() << "iface::read_solicit() loopback received and ignored";
+        return;
+    }
 
-        _pollfds[i].fd      = it->second->_pfd;
-        _pollfds[i].events  = POLLIN;
-        _pollfds[i].revents = 0;
-        i++;
+    _stats->ns_rx++;
+    
+    // Process any local addresses for interfaces that we are proxying
+    if (handle_local(saddr, taddr) == true) {
+        return;
+    }
+    
+    // We have to handle all the parents who may be interested in
+    // the reverse path towards the one who sent this solicit.
+    // In fact, the parent need to know the source address in order
+    // to respond to NDP Solicitations
+    handle_reverse_advert(saddr, _name);
+
+    // Loop through all the proxies that are using this iface to respond to NDP solicitation requests
+    bool handled = false;
+    for (std::list<weak_ptr<proxy> >::iterator pit = serves_begin(); pit != serves_end(); pit++) {
+        ptr<proxy> pr = (*pit);
+        if (!pr) continue;
+        
+        // Process the solicitation request by relating it to other
+        // interfaces or lookup up any statics routes we have configured
+        handled = true;
+        pr->handle_solicit(saddr, taddr, _name, lladdr, stamp);
+    }
+    
+    // If it was not handled then write an error message
+    if (handled == false) {
+        logger::debug() << " - solicit was ignored";
+        _stats->ignored++;
     }
 }
 
-void iface::cleanup()
+void iface::handle_advert(const uint8_t* msg, size_t len, const struct in6_addr& msg_saddr)
 {
-    for (std::map<std::string, weak_ptr<iface> >::iterator it = _map.begin();
-            it != _map.end(); ) {
-        std::map<std::string, weak_ptr<iface> >::iterator c_it = it++;
-        if (!c_it->second) {
-            _map.erase(c_it);
+    address saddr, taddr;
+    ssize_t size;
+
+    size = read_advert(msg, len, msg_saddr, saddr, taddr);
+    if (size < 0) {
+        logger::debug() << "iface::read_advert() malformed message on interface '" << _name << "'";
+        _stats->ignored++;
+        return;
+    }
+    if (size == 0) {
+        logger::debug() << "iface::read_advert() loopback received and ignored";
+        return;
+    }
+
+    _stats->na_rx++;
+    
+    // Process the NDP advert
+    bool handled = false;
+    for (std::list<weak_ptr<proxy> >::iterator pit = parents_begin(); pit != parents_end(); pit++) {
+        ptr<proxy> pr = (*pit);
+        if (!pr || !pr->ifa()) {
+            continue;
+        }
+        
+        // The proxy must have a rule for this interface or it is not meant to receive
+        // any notifications and thus they must be ignored
+        bool autovia = false;
+        bool is_relevant = false;
+        std::vector<ptr<rule> > rules;
+        pr->find_rules(taddr, rules);
+
+        for (std::vector<ptr<rule> >::iterator it = rules.begin(); it != rules.end(); it++) {
+            ptr<rule> ru = *it;
+            
+            if (ru->daughter() &&
+                ru->daughter()->name() == _name)
+            {
+                is_relevant = true;
+                autovia = ru->autovia();
+                break;
+            }
+        }
+        if (is_relevant == false) {
+            logger::debug() << "iface::read_advert() advert is not for " << _name << "...skipping";
+            continue;
         }
+        
+        // Process the NDP advertisement
+        handled = true;
+        pr->handle_advert(saddr, taddr, _name, autovia);
+    }
+    
+    // If it was not handled then write an error message
+    if (handled == false) {
+        logger::debug() << " - advert was ignored";
+        _stats->ignored++;
     }
 }
 
-int iface::poll_all()
+void iface::handle_event(int fd, uint32_t events, void* data)
 {
-    if (_map_dirty) {
-        cleanup();
-        fixup_pollfds();
-        _map_dirty = false;
-    }
+    ptr<iface> ifa = ((iface* )data)->_ptr;
 
-    if (_pollfds.size() == 0) {
-        ::sleep(1);
-        return 0;
-    }
+    bool is_pfd = (fd == ifa->_pfd);
 
-    assert(_pollfds.size() == _map.size()*  2);
+    if (events & EPOLLERR) {
+        int err = 0;
+        socklen_t len = sizeof(err);
 
-    int len;
+        // Fetching the error also clears it.
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
 
-    if ((len = ::poll(&_pollfds[0], _pollfds.size(), 50)) < 0) {
-        logger::error() << "Failed to poll interfaces: " << logger::err();
-        return -1;
+        errno = err;
+        logger::error() << "Error polling interface " << ifa->_name << ": " << logger::err();
     }
 
-    if (len == 0) {
-        return 0;
+    if (!(events & EPOLLIN)) {
+        return;
     }
 
-    std::map<std::string, weak_ptr<iface> >::iterator i_it = _map.begin();
+    // Drain the socket in batches until it's empty or until we've
+    // spent the budget, so that a busy interface can't starve the others.
 
-    int i = 0;
+    if (is_pfd && ifa->_ring) {
+        ifa->read_ring(_budget);
+        return;
+    }
 
-    for (std::vector<struct pollfd>::iterator f_it = _pollfds.begin();
-            f_it != _pollfds.end(); f_it++) {
-        assert(i_it != _map.end());
+    if (ifa->_xdp) {
+        const std::vector<ptr<xsk> >& sockets = ifa->_xdp->sockets();
 
-        if (i && !(i % 2)) {
-            i_it++;
+        for (std::vector<ptr<xsk> >::const_iterator it = sockets.begin(); it != sockets.end(); it++) {
+            if ((*it)->fd() == fd) {
+                ifa->read_xsk(*it, _budget);
+                return;
+            }
         }
+    }
 
-        bool is_pfd = i++ % 2;
-
-        ptr<iface> ifa = i_it->second;
+    for (int budget = _budget; budget > 0; ) {
+        int count = (budget < IFACE_BATCH_SIZE) ? budget : IFACE_BATCH_SIZE;
+        int n     = ifa->read_batch(fd, count);
 
-        if (f_it->revents & POLLERR) {
-            logger::error() << "Error polling interface " << ifa->_name.c_str();
-            return -1;
+        if (n <= 0) {
+            break;
         }
 
-        if (!(f_it->revents & POLLIN)) {
-            continue;
+        for (int m = 0; m < n; m++) {
+            if (is_pfd) {
+                ifa->handle_solicit(_batch.msg[m], _batch.hdr[m].msg_len, batch_stamp(m));
+            } else {
+                ifa->handle_advert(_batch.msg[m], _batch.hdr[m].msg_len,
+                                   ((struct sockaddr_in6* )&_batch.saddr[m])->sin6_addr);
+            }
         }
 
-        address saddr, daddr, taddr;
-        ssize_t size;
-
-        if (is_pfd) {
-            size = ifa->read_solicit(saddr, daddr, taddr);
-            if (size < 0) {
-                logger::error() << "Failed to read from interface '%s'", ifa->_name.c_str();
-                continue;
-            } 
-            if (size == 0) {
-                logger::debug() << "iface::read_solicit() loopback received and ignored";
-                continue;
-            }
-            
-            // Process any local addresses for interfaces that we are proxying
-            if (ifa->handle_local(saddr, taddr) == true) {
-                continue;
-            }
-            
-            // We have to handle all the parents who may be interested in
-            // the reverse path towards the one who sent this solicit.
-            // In fact, the parent need to know the source address in order
-            // to respond to NDP Solicitations
-            ifa->handle_reverse_advert(saddr, ifa->name());
-
-            // Loop through all the proxies that are using this iface to respond to NDP solicitation requests
-            bool handled = false;
-            for (std::list<weak_ptr<proxy> >::iterator pit = ifa->serves_begin(); pit != ifa->serves_end(); pit++) {
-                ptr<proxy> pr = (*pit);
-                if (!pr) continue;
-                
-                // Process the solicitation request by relating it to other
-                // interfaces or lookup up any statics routes we have configured
-                handled = true;
-                pr->handle_solicit(saddr, taddr, ifa->name());
-            }
-            
-            // If it was not handled then write an error message
-            if (handled == false) {
-                logger::debug() << " - solicit was ignored";
-            }
-            
-        } else {
-            size = ifa->read_advert(saddr, taddr);
-            if (size < 0) {
-                logger::error() << "Failed to read from interface '%s'", ifa->_name.c_str();
-                continue;
-            }
-            if (size == 0) {
-                logger::debug() << "iface::read_advert() loopback received and ignored";
-                continue;
-            }
-            
-            // Process the NDP advert
-            bool handled = false;
-            for (std::list<weak_ptr<proxy> >::iterator pit = ifa->parents_begin(); pit != ifa->parents_end(); pit++) {
-                ptr<proxy> pr = (*pit);
-                if (!pr || !pr->ifa()) {
-                    continue;
-                }
-                
-                // The proxy must have a rule for this interface or it is not meant to receive
-                // any notifications and thus they must be ignored
-                bool autovia = false;
-                bool is_relevant = false;
-                for (std::list<ptr<rule> >::iterator it = pr->rules_begin(); it != pr->rules_end(); it++) {
-                    ptr<rule> ru = *it;
-                    
-                    if (ru->addr() == taddr &&
-                        ru->daughter() &&
-                        ru->daughter()->name() == ifa->name())
-                    {
-                        is_relevant = true;
-                        autovia = ru->autovia();
-                        break;
-                    }
-                }
-                if (is_relevant == false) {
-                    logger::debug() << "iface::read_advert() advert is not for " << ifa->name() << "...skipping";
-                    continue;
-                }
-                
-                // Process the NDP advertisement
-                handled = true;
-                pr->handle_advert(saddr, taddr, ifa->name(), autovia);
-            }
-            
-            // If it was not handled then write an error message
-            if (handled == false) {
-                logger::debug() << " - advert was ignored";
-            }
+        if (n < count) {
+            break;
         }
+
+        budget -= n;
     }
+}
+
+bool iface::proxy_ndp()
+{
+    if ((_prev_proxy_ndp >= 0) || _worker)
+        return true;
+
+    std::string ndp_path   = "/proc/sys/net/ipv6/conf/" + _name + "/proxy_ndp";
+    std::string delay_path = "/proc/sys/net/ipv6/neigh/" + _name + "/proxy_delay";
 
-    return 0;
+    int prev_ndp   = read_sysctl(ndp_path);
+    int prev_delay = read_sysctl(delay_path);
+
+    if ((prev_ndp < 0) || (prev_delay < 0))
+        return false;
+
+    logger::debug()
+        << "iface::proxy_ndp() _name=\"" << _name << "\", proxy_ndp=" << prev_ndp
+        << ", proxy_delay=" << prev_delay;
+
+    if (!write_sysctl(ndp_path, 1))
+        return false;
+
+    _prev_proxy_ndp = prev_ndp;
+
+    if (write_sysctl(delay_path, 0))
+        _prev_proxy_delay = prev_delay;
+
+    return true;
+}
+
+bool iface::forwarding() const
+{
+    return read_sysctl("/proc/sys/net/ipv6/conf/" + _name + "/forwarding") > 0;
 }
 
 int iface::allmulti(int state)
@@ -833,11 +1808,54 @@ int iface::promiscuous(int state)
     return old_state;
 }
 
+int iface::budget()
+{
+    return _budget;
+}
+
+void iface::budget(int val)
+{
+    _budget = (val > 0) ? val : 256;
+}
+
 const std::string& iface::name() const
 {
     return _name;
 }
 
+counters& iface::stats()
+{
+    return *_stats;
+}
+
+void iface::update_drops()
+{
+    // Reading the statistics of a PF_PACKET socket resets them. The
+    // TPACKET_V3 version is a superset of the other one.
+
+    if (_pfd >= 0) {
+        struct tpacket_stats_v3 st;
+        socklen_t len = sizeof(st);
+
+        if (getsockopt(_pfd, SOL_PACKET, PACKET_STATISTICS, &st, &len) < 0) {
+            logger::error() << "Failed to read packet statistics of interface '" << _name << "'";
+        } else {
+            _stats->drops += st.tp_drops;
+        }
+    }
+
+    if (_xdp) {
+        uint64_t total = 0;
+
+        for (std::vector<ptr<xsk> >::const_iterator it = _xdp->sockets().begin();
+                it != _xdp->sockets().end(); it++)
+            total += (*it)->drops();
+
+        _stats->drops += total - _xsk_drops;
+        _xsk_drops = total;
+    }
+}
+
 void iface::add_serves(const ptr<proxy>& pr)
 {
     _serves.push_back(pr);
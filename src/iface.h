@@ -19,44 +19,153 @@
 #include <list>
 #include <vector>
 #include <map>
+#include <set>
 
-#include <sys/poll.h>
+#include <stdint.h>
 #include <net/ethernet.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
 
 #include "ndppd.h"
 
 NDPPD_NS_BEGIN
 
+// Maximum number of messages fetched with a single recvmmsg() call.
+#define IFACE_BATCH_SIZE 32
+
+// Maximum number of messages queued for a single sendmmsg() call.
+#define IFACE_TXQ_SIZE   64
+
+// Maximum number of solicited-node multicast groups joined on a single
+// interface before falling back to ALLMULTI.
+#define IFACE_MAX_GROUPS 256
+
 class session;
 class proxy;
+class xdp;
+class xsk;
+
+// A prebuilt ND message for a single target, with the link-layer address
+// option already filled in. Callers keep one per interface and target,
+// and the iface rebuilds it when its link-layer address has changed.
+struct nd_template {
+    uint8_t msg[32];
+
+    // Destination of a solicit; the solicited-node group of the target.
+    struct in6_addr daddr;
+
+    // Generation of the link-layer address the message was built with,
+    // or 0 if it hasn't been built yet.
+    unsigned int gen;
+
+    nd_template() :
+        gen(0)
+    {
+    }
+};
 
-class iface {
+class iface : public refcounted {
 public:
+    // Sends the 'len' messages at 'msgs' on 'fd', the way sendmmsg() does.
+    typedef int (*send_fn)(int fd, struct mmsghdr* msgs, unsigned int len);
 
     // Destructor.
     ~iface();
 
     static ptr<iface> open_ifd(const std::string& name);
 
-    static ptr<iface> open_pfd(const std::string& name, bool promiscuous);
+    static ptr<iface> open_pfd(const std::string& name, bool promiscuous, bool ring = false, bool solicited_node = false);
+
+    // Sets up an iface that has no sockets, and so doesn't need a real
+    // interface. Frames are fed to it with handle_solicit() and
+    // handle_advert(), and what it sends goes to the sender() with a
+    // descriptor of -1. Used to replay captures.
+    static ptr<iface> open_detached(const std::string& name, const struct ether_addr& hwaddr);
+
+    // Replaces sendmmsg() for all interfaces, so that what's sent can be
+    // captured rather than put on the wire.
+    static void sender(send_fn fn);
+
+    // Maximum number of messages read from a single socket per wakeup.
+    static int budget();
+
+    static void budget(int val);
+
+    // Spreads the solicits read on each listening interface over 'count'
+    // worker processes with PACKET_FANOUT. Must be called before the
+    // workers are forked.
+    static void workers(int count);
+
+    static int workers();
+
+    // Tells us which of the workers we are. Only worker 0 changes the
+    // settings of the interfaces, and restores them on exit.
+    static void worker(int index);
+
+    static int worker();
 
-    static int poll_all();
+    // Reads up to 'count' messages from 'fd' into the batch buffer using a
+    // single recvmmsg() call. Returns the number of messages read.
+    int read_batch(int fd, int count);
 
-    ssize_t read(int fd, struct sockaddr* saddr, ssize_t saddr_size, uint8_t* msg, size_t size);
+    // Queues a message for the _ifd socket. The queue is sent with a
+    // single sendmmsg() call once it's full, or by flush_all().
+    ssize_t write(const address& daddr, const uint8_t* msg, size_t size);
 
-    ssize_t write(int fd, const address& daddr, const uint8_t* msg, size_t size);
+    // Queues a complete Ethernet frame for the _pfd socket.
+    ssize_t write_raw(const uint8_t* frame, size_t size);
 
-    // Writes a NB_NEIGHBOR_SOLICIT message to the _ifd socket.
+    // Sends the messages queued on this interface.
+    void flush();
+
+    // Sends the messages queued on all interfaces.
+    static void flush_all();
+
+    // Queues a NB_NEIGHBOR_SOLICIT message for the _ifd socket.
     ssize_t write_solicit(const address& taddr);
 
-    // Writes a NB_NEIGHBOR_ADVERT message to the _ifd socket;
+    // Same as above, but with the message taken from (and if need be
+    // built into) 'tpl', which must only ever be used for 'taddr'.
+    ssize_t write_solicit(const address& taddr, nd_template& tpl);
+
+    // Queues a NB_NEIGHBOR_ADVERT message for the _ifd socket.
     ssize_t write_advert(const address& daddr, const address& taddr, bool router);
 
-    // Reads a NB_NEIGHBOR_SOLICIT message from the _pfd socket.
-    ssize_t read_solicit(address& saddr, address& daddr, address& taddr);
+    // Same as above, but with the message taken from (and if need be
+    // built into) 'tpl', which must only ever be used for 'taddr'.
+    ssize_t write_advert(const address& daddr, const address& taddr, bool router, nd_template& tpl);
+
+    // Queues a NB_NEIGHBOR_ADVERT message as a complete Ethernet frame
+    // addressed to 'lladdr' for the _pfd socket, so that the kernel
+    // doesn't have to resolve 'daddr' before sending it. Falls back to
+    // write_advert() if we don't have a link-local address to send it
+    // from, or don't know 'lladdr'.
+    ssize_t write_raw_advert(const address& daddr, const struct ether_addr& lladdr,
+                             const address& taddr, bool router, nd_template& tpl);
+
+    // Keeps the link-layer addresses of the interfaces up to date, so
+    // that the messages we send carry the right one.
+    static bool watch();
+
+    // Parses a NB_NEIGHBOR_SOLICIT frame read from the _pfd socket, either
+    // from the batch buffer or directly from the receive ring. 'lladdr'
+    // is set to the link-layer address of the sender; the one in the
+    // source link-layer address option if there is one, otherwise the
+    // source of the frame.
+    ssize_t read_solicit(const uint8_t* msg, size_t len, address& saddr, address& daddr, address& taddr,
+                         struct ether_addr& lladdr);
+
+    // Parses a NB_NEIGHBOR_ADVERT message from 'msg_saddr', read from
+    // the _ifd socket.
+    ssize_t read_advert(const uint8_t* msg, size_t len, const struct in6_addr& msg_saddr,
+                        address& saddr, address& taddr);
+
+    // Handles a frame read from the _pfd socket, which the kernel
+    // received at 'stamp' (see loop::stamp()).
+    void handle_solicit(const uint8_t* msg, size_t len, uint64_t stamp);
 
-    // Reads a NB_NEIGHBOR_ADVERT message from the _ifd socket;
-    ssize_t read_advert(address& saddr, address& taddr);
+    // Handles a message from 'saddr' read from the _ifd socket.
+    void handle_advert(const uint8_t* msg, size_t len, const struct in6_addr& saddr);
     
     bool handle_local(const address& saddr, const address& taddr);
     
@@ -64,8 +173,48 @@ public:
     
     void handle_reverse_advert(const address& saddr, const std::string& ifname);
 
+    // Installs a socket filter on the _pfd socket that only lets through
+    // the solicits for targets that one of the proxies on this interface
+    // may answer for. Needs to be called again whenever the rules, or the
+    // local addresses of their interfaces, change.
+    bool update_filter();
+
+    // Joins the solicited-node multicast groups of the targets that the
+    // proxies on this interface may answer for, and leaves the ones that
+    // are no longer needed. Falls back to ALLMULTI if the rules are too
+    // wide for that. Only used if the interface was opened with
+    // 'solicited_node'.
+    bool update_groups();
+
+    // Attaches an XDP program to the interface that hands the solicits
+    // for our targets to AF_XDP sockets, which are then read instead of
+    // the _pfd socket. The prefixes are kept up to date by update_filter().
+    bool open_xdp();
+
+    // Returns true if any interface has an XDP program attached.
+    static bool any_xdp();
+
+    // Calls update_filter() and update_groups() for all interfaces.
+    static void update_filters();
+
+    // Turns on proxy_ndp for this interface, and turns off proxy_delay so
+    // that the kernel answers solicits for proxy neighbor entries right
+    // away. The previous settings are restored when the iface goes away.
+    bool proxy_ndp();
+
+    // Returns true if IPv6 forwarding is enabled on this interface. The
+    // kernel only answers for proxy neighbor entries when it is.
+    bool forwarding() const;
+
     // Returns the name of the interface.
     const std::string& name() const;
+
+    // Returns the counters of this interface.
+    counters& stats();
+
+    // Adds the frames that the kernel has dropped on our sockets since
+    // the last call to the drop counter.
+    void update_drops();
     
     std::list<weak_ptr<proxy> >::iterator serves_begin();
     
@@ -83,15 +232,58 @@ public:
 
 private:
 
-    static bool _map_dirty;
+    static int _budget;
+
+    static int _workers;
+
+    static int _worker;
+
+    static int _fanout_id;
+
+    static send_fn _send;
+
+    // Interfaces that have messages waiting in their transmit queue.
+    static std::list<weak_ptr<iface> > _flushq;
+
+    // Fills in 'tpl' for 'taddr' unless it's up to date already.
+    void build_solicit(const address& taddr, nd_template& tpl);
+
+    void build_advert(const address& taddr, nd_template& tpl);
 
-    // An array of objects used with ::poll.
-    static std::vector<struct pollfd> _pollfds;
+    // Re-reads the link-layer addresses of all interfaces.
+    static void resync();
 
-    // Updates the array above.
-    static void fixup_pollfds();
+    // Handles a RTM_NEWLINK message.
+    static void handle_rtnl(const struct nlmsghdr* nlh);
 
-    static void cleanup();
+    // Takes note of the link-layer address of the interface.
+    void set_hwaddr(const uint8_t* addr);
+
+    // Invoked by the event loop when one of our sockets is ready.
+    static void handle_event(int fd, uint32_t events, void* data);
+
+    // Adds the _pfd socket to the fanout group of this interface.
+    bool join_fanout();
+
+    // Sets up a TPACKET_V3 receive ring for the _pfd socket.
+    bool open_ring();
+
+    // Handles the frames of the blocks the kernel has handed over to us
+    // in the receive ring. Returns the number of frames handled.
+    int read_ring(int budget);
+
+    // Handles up to 'budget' frames waiting in the AF_XDP socket 'xs'.
+    // Returns the number of frames handled.
+    int read_xsk(const ptr<xsk>& xs, int budget);
+
+    // Collects the prefixes, without overlaps, of the targets that the
+    // proxies on this interface may answer for. Returns false if we need
+    // to see all solicits.
+    bool collect_prefixes(std::vector<address>& prefixes);
+
+    // Joins (PACKET_ADD_MEMBERSHIP) or leaves (PACKET_DROP_MEMBERSHIP) the
+    // solicited-node group with the low 24 bits 'group'.
+    bool membership(int op, uint32_t group);
 
     // Weak pointer so this object can reference itself.
     weak_ptr<iface> _ptr;
@@ -104,12 +296,62 @@ private:
     // NB_NEIGHBOR_SOLICIT messages.
     int _pfd;
 
+    // Memory-mapped TPACKET_V3 receive ring of the _pfd socket, or NULL
+    // if the socket is read with recvmmsg().
+    uint8_t* _ring;
+
+    // Number of blocks in the ring, and the size of each block.
+    unsigned int _ring_block_nr, _ring_block_size;
+
+    // Index of the next block we expect the kernel to hand over.
+    unsigned int _ring_block;
+
+    // XDP program and AF_XDP sockets, if any.
+    ptr<xdp> _xdp;
+
+    // Drops reported by the AF_XDP sockets so far. Unlike the _pfd
+    // socket, they report a running total.
+    uint64_t _xsk_drops;
+
+    counters* _stats;
+
+    struct txq_entry {
+        struct sockaddr_in6 daddr;
+        uint8_t msg[128];
+        size_t size;
+    };
+
+    // Messages waiting to be sent on the _ifd socket.
+    std::vector<txq_entry> _txq;
+
+    // Number of messages in the queue above.
+    unsigned int _txq_len;
+
+    // Ethernet frames waiting to be sent on the _pfd socket, and how many.
+    std::vector<txq_entry> _rawq;
+
+    unsigned int _rawq_len;
+
+    // Sends the first 'len' messages of 'q' on 'fd' with sendmmsg(). The
+    // messages of the _pfd socket don't need a destination.
+    void flush(int fd, std::vector<txq_entry>& q, unsigned int& len, bool named);
+
     // Previous state of ALLMULTI for the interface.
     int _prev_allmulti;
     
     // Previous state of PROMISC for the interface
     int _prev_promiscuous;
 
+    // Whether to join solicited-node groups rather than turn on ALLMULTI,
+    // and the groups (low 24 bits) we've joined.
+    bool _solicited_node;
+
+    std::set<uint32_t> _groups;
+
+    // Previous values of the proxy_ndp and proxy_delay sysctls for the
+    // interface, or -1 if we haven't touched them.
+    int _prev_proxy_ndp, _prev_proxy_delay;
+
     // Name of this interface.
     std::string _name;
     
@@ -120,6 +362,10 @@ private:
     // The link-layer address of this interface.
     struct ether_addr hwaddr;
 
+    // Bumped whenever 'hwaddr' changes, so that templates built with the
+    // previous one are rebuilt.
+    unsigned int _hwaddr_gen;
+
     // Turns on/off ALLMULTI for this interface - returns the previous state
     // or -1 if there was an error.
     int allmulti(int state);
@@ -0,0 +1,274 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <cstring>
+
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "ndppd.h"
+#include "loop.h"
+
+NDPPD_NS_BEGIN
+
+int loop::_epfd = -1;
+
+int loop::_tfd = -1;
+
+std::vector<loop::handler> loop::_handlers;
+
+uint64_t loop::_deadline;
+
+uint64_t loop::_armed;
+
+uint64_t loop::_lag_sum;
+
+uint64_t loop::_lag_count;
+
+uint64_t loop::_lag_max;
+
+bool loop::init()
+{
+    if (_epfd >= 0)
+        return true;
+
+    if ((_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        logger::error() << "loop::init() failed epoll_create1: " << logger::err();
+        return false;
+    }
+
+    if ((_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        logger::error() << "loop::init() failed timerfd_create: " << logger::err();
+        return false;
+    }
+
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events  = EPOLLIN;
+    ev.data.fd = _tfd;
+
+    if (epoll_ctl(_epfd, EPOLL_CTL_ADD, _tfd, &ev) < 0) {
+        logger::error() << "loop::init() failed to watch timerfd: " << logger::err();
+        return false;
+    }
+
+    return true;
+}
+
+void loop::cleanup()
+{
+    if (_tfd >= 0) {
+        close(_tfd);
+        _tfd = -1;
+    }
+
+    if (_epfd >= 0) {
+        close(_epfd);
+        _epfd = -1;
+    }
+
+    _handlers.clear();
+}
+
+bool loop::add(int fd, callback cb, void* data)
+{
+    if ((_epfd < 0) && !init())
+        return false;
+
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events  = EPOLLIN;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        logger::error() << "loop::add() failed! error=" << logger::err() << ", fd=" << fd;
+        return false;
+    }
+
+    if (_handlers.size() <= (size_t)fd)
+        _handlers.resize(fd + 1);
+
+    _handlers[fd].cb   = cb;
+    _handlers[fd].data = data;
+
+    logger::debug() << "loop::add() fd=" << fd;
+
+    return true;
+}
+
+bool loop::modify(int fd, uint32_t events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events  = events;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        logger::error() << "loop::modify() failed! error=" << logger::err() << ", fd=" << fd;
+        return false;
+    }
+
+    return true;
+}
+
+void loop::remove(int fd)
+{
+    if ((fd < 0) || (_handlers.size() <= (size_t)fd) || !_handlers[fd].cb)
+        return;
+
+    epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, NULL);
+
+    _handlers[fd].cb   = NULL;
+    _handlers[fd].data = NULL;
+
+    logger::debug() << "loop::remove() fd=" << fd;
+}
+
+uint64_t loop::now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t loop::lag_sum()
+{
+    return _lag_sum;
+}
+
+uint64_t loop::lag_count()
+{
+    return _lag_count;
+}
+
+uint64_t loop::lag_max()
+{
+    uint64_t lag = _lag_max;
+    _lag_max = 0;
+    return lag;
+}
+
+uint64_t loop::stamp()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void loop::wakeup_in(int ms)
+{
+    uint64_t deadline = now() + ((ms > 0) ? ms : 0);
+
+    if (!_deadline || (deadline < _deadline))
+        _deadline = deadline;
+}
+
+void loop::arm(uint64_t deadline)
+{
+    if (deadline == _armed)
+        return;
+
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+
+    // An all-zero it_value disarms the timer.
+    its.it_value.tv_sec  = deadline / 1000;
+    its.it_value.tv_nsec = (deadline % 1000) * 1000000;
+
+    if (timerfd_settime(_tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        logger::error() << "loop::arm() failed timerfd_settime: " << logger::err();
+        return;
+    }
+
+    _armed = deadline;
+}
+
+int loop::poll(const sigset_t* sigmask)
+{
+    if ((_epfd < 0) && !init())
+        return -1;
+
+    int timeout = -1;
+
+    uint64_t deadline = _deadline;
+
+    if (_deadline && (_deadline <= now())) {
+        timeout = 0;
+    } else {
+        arm(_deadline);
+    }
+
+    _deadline = 0;
+
+    struct epoll_event events[64];
+
+    int len;
+
+    if ((len = epoll_pwait(_epfd, events, 64, timeout, sigmask)) < 0) {
+        if (errno == EINTR)
+            return 0;
+
+        logger::error() << "Failed to wait for events: " << logger::err();
+        return -1;
+    }
+
+    for (int i = 0; i < len; i++) {
+        int fd = events[i].data.fd;
+
+        if (fd == _tfd) {
+            uint64_t expirations;
+            while (::read(_tfd, &expirations, sizeof(expirations)) > 0)
+                ;
+            _armed = 0;
+            continue;
+        }
+
+        // The descriptor may have been removed by an earlier callback.
+        if ((_handlers.size() <= (size_t)fd) || !_handlers[fd].cb)
+            continue;
+
+        _handlers[fd].cb(fd, events[i].events, _handlers[fd].data);
+    }
+
+    // The caller deals with whatever was due once we return.
+
+    uint64_t t = now();
+
+    if (deadline && (deadline <= t)) {
+        uint64_t lag = t - deadline;
+
+        _lag_sum += lag;
+        _lag_count++;
+
+        if (lag > _lag_max)
+            _lag_max = lag;
+    }
+
+    return len;
+}
+
+NDPPD_NS_END
@@ -0,0 +1,99 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <vector>
+
+#include <stdint.h>
+#include <signal.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// The event loop. Sockets are watched with epoll, and a timerfd wakes the
+// loop up when the earliest deadline requested with wakeup_in() is due,
+// so the daemon sleeps for as long as there is nothing to do.
+
+class loop {
+public:
+    // Called with the descriptor and the epoll events that are pending.
+    typedef void (*callback)(int fd, uint32_t events, void* data);
+
+    static bool init();
+
+    static void cleanup();
+
+    // Starts watching 'fd' for input.
+    static bool add(int fd, callback cb, void* data);
+
+    // Changes the epoll events 'fd' is watched for, such as EPOLLOUT
+    // while there's output waiting to be written to it.
+    static bool modify(int fd, uint32_t events);
+
+    // Stops watching 'fd'.
+    static void remove(int fd);
+
+    // Makes sure the next call to poll() returns within 'ms' milliseconds.
+    static void wakeup_in(int ms);
+
+    // Waits for input or for the next deadline, and invokes the callbacks
+    // of the descriptors that are ready. 'sigmask' is the signal mask
+    // to use while waiting.
+    static int poll(const sigset_t* sigmask = NULL);
+
+    // Returns the monotonic time in milliseconds.
+    static uint64_t now();
+
+    // Returns the time of day in nanoseconds, which is what the kernel
+    // timestamps packets with.
+    static uint64_t stamp();
+
+    // How late, in milliseconds, poll() returned after the deadlines it
+    // was asked to wake up for, counting the time spent in callbacks. The
+    // sum and number of deadlines, and the worst lag since the last call
+    // to lag_max().
+    static uint64_t lag_sum();
+
+    static uint64_t lag_count();
+
+    static uint64_t lag_max();
+
+private:
+    struct handler {
+        callback cb;
+        void* data;
+    };
+
+    static int _epfd;
+
+    static int _tfd;
+
+    // Callbacks indexed by descriptor.
+    static std::vector<handler> _handlers;
+
+    // Earliest deadline requested since the last poll(), or 0 if none.
+    static uint64_t _deadline;
+
+    // Deadline the timerfd is currently armed with, or 0 if disarmed.
+    static uint64_t _armed;
+
+    static uint64_t _lag_sum, _lag_count, _lag_max;
+
+    static void arm(uint64_t deadline);
+};
+
+NDPPD_NS_END
@@ -0,0 +1,402 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <map>
+
+#include <unistd.h>
+#include <errno.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include "ndppd.h"
+#include "metrics.h"
+
+NDPPD_NS_BEGIN
+
+int metrics::_fd = -1;
+
+std::string metrics::_path;
+
+std::map<int, metrics::client> metrics::_clients;
+
+bool metrics::open(const std::string& addr)
+{
+    struct sockaddr_storage ss;
+    socklen_t len;
+
+    memset(&ss, 0, sizeof(ss));
+
+    int worker = iface::worker();
+
+    if (!addr.empty() && (addr[0] == '/')) {
+        struct sockaddr_un* sun = (struct sockaddr_un* )&ss;
+
+        std::string path = addr;
+
+        if (worker)
+            path += logger::format(".%d", worker);
+
+        if (path.size() >= sizeof(sun->sun_path)) {
+            logger::error() << "Metrics socket path '" << path << "' is too long";
+            return false;
+        }
+
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, path.c_str());
+        len = sizeof(struct sockaddr_un);
+
+        unlink(path.c_str());
+        _path = path;
+    } else {
+        std::string::size_type pos = addr.rfind(':');
+
+        if ((pos == std::string::npos) || (pos + 1 == addr.size())) {
+            logger::error() << "Metrics address '" << addr << "' lacks a port";
+            return false;
+        }
+
+        std::string host = addr.substr(0, pos);
+        int port = atoi(addr.c_str() + pos + 1) + worker;
+
+        if ((host.size() >= 2) && (host[0] == '[') && (host[host.size() - 1] == ']'))
+            host = host.substr(1, host.size() - 2);
+
+        struct sockaddr_in6* sin6 = (struct sockaddr_in6* )&ss;
+        struct sockaddr_in* sin   = (struct sockaddr_in* )&ss;
+
+        if (inet_pton(AF_INET6, host.c_str(), &sin6->sin6_addr) == 1) {
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_port   = htons(port);
+            len = sizeof(struct sockaddr_in6);
+        } else if (inet_pton(AF_INET, host.c_str(), &sin->sin_addr) == 1) {
+            sin->sin_family = AF_INET;
+            sin->sin_port   = htons(port);
+            len = sizeof(struct sockaddr_in);
+        } else {
+            logger::error() << "Invalid metrics address '" << addr << "'";
+            return false;
+        }
+    }
+
+    if ((_fd = socket(ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        logger::error() << "Unable to create metrics socket: " << logger::err();
+        return false;
+    }
+
+    int on = 1;
+    setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if ((bind(_fd, (struct sockaddr* )&ss, len) < 0) || (listen(_fd, 16) < 0) ||
+        !loop::add(_fd, handle_accept, NULL)) {
+        logger::error() << "Failed to listen for metrics on '" << addr << "': " << logger::err();
+        close();
+        return false;
+    }
+
+    logger::debug() << "metrics::open() addr=" << addr;
+
+    return true;
+}
+
+void metrics::close()
+{
+    while (!_clients.empty())
+        disconnect(_clients.begin()->first);
+
+    if (_fd >= 0) {
+        loop::remove(_fd);
+        ::close(_fd);
+        _fd = -1;
+    }
+
+    if (!_path.empty()) {
+        unlink(_path.c_str());
+        _path.clear();
+    }
+}
+
+void metrics::handle_accept(int fd, uint32_t events, void* data)
+{
+    int cfd;
+
+    while ((cfd = accept4(_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        if (!loop::add(cfd, handle_client, NULL)) {
+            ::close(cfd);
+            continue;
+        }
+
+        _clients[cfd] = client();
+    }
+}
+
+void metrics::disconnect(int fd)
+{
+    loop::remove(fd);
+    ::close(fd);
+    _clients.erase(fd);
+}
+
+void metrics::handle_client(int fd, uint32_t events, void* data)
+{
+    std::map<int, client>::iterator it = _clients.find(fd);
+
+    if (it == _clients.end())
+        return;
+
+    client& cl = it->second;
+
+    if (!cl.done) {
+        char buf[2048];
+        ssize_t len;
+
+        while ((len = recv(fd, buf, sizeof(buf), 0)) > 0)
+            cl.in.append(buf, len);
+
+        if (((len < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) ||
+            (cl.in.size() > METRICS_MAX_REQUEST)) {
+            disconnect(fd);
+            return;
+        }
+
+        // Wait for the rest of the headers, unless the client has shut down
+        // its side of the connection; a complete request still gets an
+        // answer in that case.
+        if ((cl.in.find("\r\n\r\n") == std::string::npos) && (cl.in.find("\n\n") == std::string::npos)) {
+            if (len == 0)
+                disconnect(fd);
+
+            return;
+        }
+
+        respond(cl);
+        cl.done = true;
+    }
+
+    while (!cl.out.empty()) {
+        ssize_t len = send(fd, cl.out.data(), cl.out.size(), MSG_NOSIGNAL);
+
+        if (len < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                break;
+
+            disconnect(fd);
+            return;
+        }
+
+        cl.out.erase(0, len);
+    }
+
+    if (cl.out.empty()) {
+        disconnect(fd);
+        return;
+    }
+
+    // Only wait for the socket to drain from now on.
+    if (!(events & EPOLLOUT))
+        loop::modify(fd, EPOLLOUT);
+}
+
+void metrics::respond(client& cl)
+{
+    std::string line = cl.in.substr(0, cl.in.find_first_of("\r\n"));
+
+    std::string status, body;
+
+    if (line.compare(0, 4, "GET ") && line.compare(0, 5, "HEAD ")) {
+        status = "405 Method Not Allowed";
+    } else {
+        std::string::size_type start = line.find(' ') + 1;
+        std::string target = line.substr(start, line.find(' ', start) - start);
+
+        if ((target == "/metrics") || (target == "/")) {
+            status = "200 OK";
+            render(body);
+        } else {
+            status = "404 Not Found";
+        }
+    }
+
+    cl.out = "HTTP/1.0 " + status + "\r\n"
+             "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n" +
+             logger::format("Content-Length: %u\r\n", (unsigned int)body.size()) +
+             "Connection: close\r\n\r\n";
+
+    if (line.compare(0, 5, "HEAD "))
+        cl.out += body;
+}
+
+// Which objects a counter is exported for.
+enum {
+    M_IFACE = 1,
+    M_PROXY = 2,
+    M_RULE  = 4
+};
+
+static const struct {
+    uint64_t counters::* field;
+    const char* name;
+    const char* help;
+    int scope;
+} counter_fields[] = {
+    { &counters::ns_rx, "solicits_received_total", "Neighbor solicitations received.", M_IFACE | M_PROXY | M_RULE },
+    { &counters::ns_tx, "solicits_sent_total", "Neighbor solicitations sent.", M_IFACE | M_PROXY | M_RULE },
+    { &counters::na_rx, "adverts_received_total", "Neighbor advertisements received.", M_IFACE | M_PROXY | M_RULE },
+    { &counters::na_tx, "adverts_sent_total", "Neighbor advertisements sent.", M_IFACE | M_PROXY | M_RULE },
+    { &counters::retries, "solicit_retries_total", "Solicitations sent again after going unanswered.", M_PROXY | M_RULE },
+    { &counters::ignored, "ignored_total", "Messages that were malformed or not acted upon.", M_IFACE | M_PROXY },
+    { &counters::drops, "drops_total", "Frames dropped by the kernel before they could be read.", M_IFACE },
+    { &counters::sessions_created, "sessions_created_total", "Sessions created.", M_PROXY | M_RULE },
+    { &counters::sessions_expired, "sessions_expired_total", "Valid sessions that expired.", M_PROXY | M_RULE },
+    { &counters::sessions_invalid, "sessions_invalid_total", "Sessions whose target never answered.", M_PROXY | M_RULE },
+    { &counters::routes_added, "routes_added_total", "Routes added by autowire.", M_PROXY | M_RULE },
+    { &counters::routes_removed, "routes_removed_total", "Routes removed by autowire.", M_PROXY | M_RULE },
+    { &counters::route_errors, "route_errors_total", "Autowire route requests that failed.", M_PROXY | M_RULE }
+};
+
+static void family(std::string& out, const std::string& name, const char* type, const char* help)
+{
+    out += "# HELP " + name + " " + help + "\n";
+    out += "# TYPE " + name + " " + type + "\n";
+}
+
+void metrics::render(std::string& out)
+{
+    struct source {
+        int scope;
+        std::string labels;
+        const counters* stats;
+    };
+
+    std::vector<source> sources;
+    std::vector<ptr<proxy> > proxies;
+
+    for (std::map<std::string, weak_ptr<iface> >::iterator i_it = iface::_map.begin(); i_it != iface::_map.end(); i_it++) {
+        ptr<iface> ifa = i_it->second;
+
+        if (!ifa)
+            continue;
+
+        ifa->update_drops();
+
+        source s;
+        s.scope  = M_IFACE;
+        s.labels = "iface=\"" + ifa->name() + "\"";
+        s.stats  = &ifa->stats();
+        sources.push_back(s);
+
+        for (std::list<weak_ptr<proxy> >::iterator pit = ifa->serves_begin(); pit != ifa->serves_end(); pit++) {
+            ptr<proxy> pr = (*pit);
+            if (!pr) continue;
+
+            proxies.push_back(pr);
+
+            s.scope  = M_PROXY;
+            s.labels = "proxy=\"" + ifa->name() + "\"";
+            s.stats  = &pr->stats();
+            sources.push_back(s);
+
+            for (std::list<ptr<rule> >::iterator rit = pr->rules_begin(); rit != pr->rules_end(); rit++) {
+                s.scope  = M_RULE;
+                s.labels = "proxy=\"" + ifa->name() + "\",rule=\"" + (*rit)->addr().to_string() + "\"";
+                s.stats  = &(*rit)->stats();
+                sources.push_back(s);
+            }
+        }
+    }
+
+    static const struct {
+        int scope;
+        const char* prefix;
+    } scopes[] = {
+        { M_IFACE, "ndppd_iface_" },
+        { M_PROXY, "ndppd_proxy_" },
+        { M_RULE, "ndppd_rule_" }
+    };
+
+    for (size_t i = 0; i < sizeof(scopes) / sizeof(scopes[0]); i++) {
+        for (size_t f = 0; f < sizeof(counter_fields) / sizeof(counter_fields[0]); f++) {
+            if (!(counter_fields[f].scope & scopes[i].scope))
+                continue;
+
+            std::string name = std::string(scopes[i].prefix) + counter_fields[f].name;
+
+            family(out, name, "counter", counter_fields[f].help);
+
+            for (std::vector<source>::iterator it = sources.begin(); it != sources.end(); it++) {
+                if (it->scope == scopes[i].scope) {
+                    out += name + "{" + it->labels + "} " +
+                           logger::format("%llu\n", (unsigned long long)(it->stats->*counter_fields[f].field));
+                }
+            }
+        }
+    }
+
+    // Sessions by state.
+
+    // In the order of the session states.
+    static const char* states[] = { "waiting", "renewing", "valid", "invalid" };
+
+    family(out, "ndppd_sessions", "gauge", "Sessions by state.");
+
+    for (std::vector<ptr<proxy> >::iterator pit = proxies.begin(); pit != proxies.end(); pit++) {
+        for (int i = 0; i < 4; i++) {
+            out += "ndppd_sessions{proxy=\"" + (*pit)->ifa()->name() + "\",state=\"" + states[i] + "\"} " +
+                   logger::format("%d\n", (*pit)->session_count(i));
+        }
+    }
+
+    // Solicit-to-advert latency.
+
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+    family(out, "ndppd_proxy_advert_latency_seconds", "summary",
+           "Time from receiving a solicit to answering it, for targets with a valid session (hit) and for those that had to be discovered first (discovery).");
+
+    for (std::vector<ptr<proxy> >::iterator pit = proxies.begin(); pit != proxies.end(); pit++) {
+        for (int i = 0; i < 2; i++) {
+            const histogram& h = i ? (*pit)->discovery_latency() : (*pit)->hit_latency();
+
+            std::string labels = "proxy=\"" + (*pit)->ifa()->name() + "\",case=\"" + (i ? "discovery" : "hit") + "\"";
+
+            for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+                out += "ndppd_proxy_advert_latency_seconds{" + labels + logger::format(",quantile=\"%g\"} %.9f\n",
+                       quantiles[q], h.quantile(quantiles[q]) / 1e9);
+            }
+
+            out += "ndppd_proxy_advert_latency_seconds_sum{" + labels + logger::format("} %.9f\n", h.sum() / 1e9);
+            out += "ndppd_proxy_advert_latency_seconds_count{" + labels + logger::format("} %llu\n", (unsigned long long)h.count());
+        }
+    }
+
+    // Event loop.
+
+    family(out, "ndppd_loop_lag_seconds", "summary", "How late the event loop got around to its deadlines.");
+    out += logger::format("ndppd_loop_lag_seconds_sum %.3f\n", loop::lag_sum() / 1000.0);
+    out += logger::format("ndppd_loop_lag_seconds_count %llu\n", (unsigned long long)loop::lag_count());
+
+    family(out, "ndppd_loop_lag_max_seconds", "gauge", "Worst event loop lag since the previous scrape.");
+    out += logger::format("ndppd_loop_lag_max_seconds %.3f\n", loop::lag_max() / 1000.0);
+}
+
+NDPPD_NS_END
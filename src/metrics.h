@@ -0,0 +1,81 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <string>
+#include <map>
+
+#include <stdint.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// Maximum size of an HTTP request, headers included.
+#define METRICS_MAX_REQUEST 8192
+
+// A minimal HTTP server, served from the event loop, that answers
+// "GET /metrics" with the counters of all interfaces, proxies and rules,
+// the number of sessions in each state, and the lag of the event loop,
+// in the Prometheus text format. Every connection gets one response and
+// is then closed; sockets are never waited on, so a slow scraper can't
+// hold up anything else.
+
+class metrics {
+public:
+    // Starts listening on 'addr', which is either the path of a
+    // UNIX-domain socket, or an address and port such as 127.0.0.1:9100
+    // or [::1]:9100. Worker N (see iface::worker()) listens on the N:th
+    // port after the given one, or on <path>.N.
+    static bool open(const std::string& addr);
+
+    // Stops listening, and disconnects all clients.
+    static void close();
+
+    // Appends the metrics to 'out'.
+    static void render(std::string& out);
+
+private:
+    struct client {
+        std::string in, out;
+
+        // Set once the response is in 'out'.
+        bool done;
+
+        client() :
+            done(false)
+        {
+        }
+    };
+
+    static int _fd;
+
+    // Path of the UNIX-domain socket, if that's what we're listening on.
+    static std::string _path;
+
+    static std::map<int, client> _clients;
+
+    static void handle_accept(int fd, uint32_t events, void* data);
+
+    static void handle_client(int fd, uint32_t events, void* data);
+
+    static void disconnect(int fd);
+
+    // Fills in the response to the request in 'cl.in'.
+    static void respond(client& cl);
+};
+
+NDPPD_NS_END
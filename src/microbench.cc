@@ -0,0 +1,398 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Microbenchmarks for the primitives that dominate the daemon's profile:
+// addresses, rule lookups, the session table and the session timers. Each
+// one prints the time per operation, so that changes to the data
+// structures can be compared. Run with 'make bench', or give the names of
+// the benchmarks to run on the command line.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <time.h>
+#include <net/ethernet.h>
+#include <sys/socket.h>
+
+#include "ndppd.h"
+
+using namespace ndppd;
+
+static uint64_t clock_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Keeps the compiler from optimizing away what's being measured.
+static volatile uint64_t sink;
+
+static void report(const char* name, uint64_t ops, uint64_t ns)
+{
+    printf("%-32s %12llu %12.1f\n", name, (unsigned long long)ops, ops ? (double)ns / ops : 0);
+}
+
+static uint64_t xorshift(uint64_t& state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// Returns 'count' addresses within 'prefix', the same ones every time.
+static void make_addresses(const address& prefix, size_t count, std::vector<address>& addrs)
+{
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+
+    addrs.reserve(addrs.size() + count);
+
+    for (size_t i = 0; i < count; i++) {
+        struct in6_addr a;
+
+        for (int b = 0; b < 16; b++) {
+            int keep = prefix.prefix() - b * 8;
+            uint8_t mask = (keep >= 8) ? 0xff : ((keep <= 0) ? 0 : (uint8_t)(0xff << (8 - keep)));
+
+            a.s6_addr[b] = (prefix.const_addr().s6_addr[b] & mask) | ((uint8_t)xorshift(state) & ~mask);
+        }
+
+        addrs.push_back(address(a));
+    }
+}
+
+// Throws away what the interfaces would have sent.
+static int discard(int fd, struct mmsghdr* msgs, unsigned int len)
+{
+    return len;
+}
+
+// Returns a proxy on a detached interface of its own, with a detached
+// daughter interface.
+static ptr<proxy> make_proxy(ptr<iface>& daughter)
+{
+    static int n;
+
+    struct ether_addr hwaddr = { { 0x02, 0, 0, 0, 0, 0 } };
+    char name[32];
+
+    hwaddr.ether_addr_octet[5] = ++n;
+    snprintf(name, sizeof(name), "bench%d", n);
+
+    ptr<proxy> pr = proxy::create(iface::open_detached(name, hwaddr), false);
+
+    hwaddr.ether_addr_octet[5] = ++n;
+    snprintf(name, sizeof(name), "bench%d", n);
+
+    daughter = iface::open_detached(name, hwaddr);
+    daughter->add_parent(pr);
+
+    return pr;
+}
+
+static void bench_address()
+{
+    const int N = 1000000;
+
+    std::vector<address> addrs;
+    make_addresses(address("2001:db8::/32"), 1024, addrs);
+
+    std::vector<std::string> strs;
+
+    for (size_t i = 0; i < addrs.size(); i++)
+        strs.push_back(addrs[i].to_string());
+
+    uint64_t t = clock_ns(), hits = 0;
+
+    for (int i = 0; i < N; i++)
+        hits += (addrs[i & 1023] == addrs[(i * 7) & 1023]);
+
+    report("address::operator==", N, clock_ns() - t);
+
+    address pfx("2001:db8::/48");
+
+    t = clock_ns();
+
+    for (int i = 0; i < N; i++)
+        hits += (pfx == addrs[i & 1023]);
+
+    report("address::operator== (prefix)", N, clock_ns() - t);
+
+    t = clock_ns();
+
+    for (int i = 0; i < N; i++)
+        hits += addrs[i & 1023].prefix();
+
+    report("address::prefix", N, clock_ns() - t);
+
+    address a;
+
+    t = clock_ns();
+
+    for (int i = 0; i < N; i++)
+        hits += a.parse_string(strs[i & 1023]);
+
+    report("address::parse_string", N, clock_ns() - t);
+
+    t = clock_ns();
+
+    for (int i = 0; i < N; i++)
+        hits += addrs[i & 1023].to_string().size();
+
+    report("address::to_string", N, clock_ns() - t);
+
+    sink = hits;
+}
+
+static void bench_rules()
+{
+    static const int sizes[] = { 10, 1000, 100000 };
+    const int N = 1000000;
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        ptr<iface> daughter;
+        ptr<proxy> pr = make_proxy(daughter);
+
+        // One /64 per rule, spread over a /32.
+
+        std::vector<address> prefixes;
+        make_addresses(address("2001:db8::/32"), sizes[s], prefixes);
+
+        for (size_t i = 0; i < prefixes.size(); i++) {
+            prefixes[i].prefix(64);
+            pr->add_rule(prefixes[i], false);
+        }
+
+        // Half of the lookups hit a rule, half miss.
+
+        std::vector<address> taddrs;
+
+        for (size_t i = 0; i < 1024; i += 2) {
+            make_addresses(prefixes[(i * 31) % prefixes.size()], 1, taddrs);
+            make_addresses(address("2001:db9::/32"), 1, taddrs);
+        }
+
+        std::vector<ptr<rule> > rules;
+        uint64_t t = clock_ns(), hits = 0;
+
+        for (int i = 0; i < N; i++) {
+            rules.clear();
+            pr->find_rules(taddrs[i & 1023], rules);
+            hits += rules.size();
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "proxy::find_rules (%d rules)", sizes[s]);
+        report(name, N, clock_ns() - t);
+
+        sink = hits;
+    }
+}
+
+static void bench_sessions()
+{
+    static const int sizes[] = { 1000, 10000, 100000, 1000000 };
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s];
+
+        ptr<iface> daughter;
+        ptr<proxy> pr = make_proxy(daughter);
+
+        pr->add_rule(address("2001:db8::/32"), daughter, false);
+
+        std::vector<address> taddrs;
+        make_addresses(address("2001:db8::/32"), n, taddrs);
+
+        char name[64];
+
+        uint64_t t = clock_ns();
+
+        for (int i = 0; i < n; i++)
+            pr->find_or_create_session(taddrs[i]);
+
+        snprintf(name, sizeof(name), "session create (%d)", n);
+        report(name, n, clock_ns() - t);
+
+        // Look them up in a different order than they were created in.
+
+        uint64_t hits = 0;
+
+        t = clock_ns();
+
+        for (int i = 0; i < n; i++)
+            hits += !pr->find_or_create_session(taddrs[((uint64_t)i * 7919) % n]).is_null();
+
+        snprintf(name, sizeof(name), "session find (%d)", n);
+        report(name, n, clock_ns() - t);
+
+        std::vector<ptr<session> > sessions;
+        pr->sessions(sessions);
+
+        t = clock_ns();
+
+        for (std::vector<ptr<session> >::iterator it = sessions.begin(); it != sessions.end(); it++)
+            pr->remove_session(*it);
+
+        sessions.clear();
+
+        snprintf(name, sizeof(name), "session remove (%d)", n);
+        report(name, n, clock_ns() - t);
+
+        sink = hits;
+    }
+}
+
+// Creates 'n' sessions on a proxy with a daughter interface, with the
+// given timings.
+static ptr<proxy> make_sessions(int n, int ttl, int timeout, int retries)
+{
+    ptr<iface> daughter;
+    ptr<proxy> pr = make_proxy(daughter);
+
+    pr->ttl(ttl);
+    pr->timeout(timeout);
+    pr->retries(retries);
+    pr->add_rule(address("2001:db8::/32"), daughter, false);
+
+    std::vector<address> taddrs;
+    make_addresses(address("2001:db8::/32"), n, taddrs);
+
+    for (int i = 0; i < n; i++)
+        pr->find_or_create_session(taddrs[i]);
+
+    return pr;
+}
+
+static void remove_sessions(const ptr<proxy>& pr)
+{
+    std::vector<ptr<session> > sessions;
+    pr->sessions(sessions);
+
+    for (std::vector<ptr<session> >::iterator it = sessions.begin(); it != sessions.end(); it++)
+        pr->remove_session(*it);
+}
+
+static void bench_timers()
+{
+    static const int sizes[] = { 1000, 100000 };
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s];
+        char name[64];
+
+        // Ticks with nothing due, while the sessions wait out their TTL.
+
+        ptr<proxy> pr = make_sessions(n, 60000, 500, 3);
+
+        const int IDLE = 100000;
+
+        uint64_t t = clock_ns();
+
+        for (int i = 0; i < IDLE; i++)
+            session::update_all();
+
+        snprintf(name, sizeof(name), "session::update_all idle (%d)", n);
+        report(name, IDLE, clock_ns() - t);
+
+        remove_sessions(pr);
+
+        // Ticks that expire all of the sessions. They time out every
+        // millisecond and never give up, so once the first tick has lined
+        // them up, each of them sends a solicit on every tick.
+
+        pr = make_sessions(n, 1, 1, 1 << 30);
+
+        const int TICKS = 10;
+        uint64_t ns = 0;
+
+        for (int i = 0; i <= TICKS; i++) {
+            uint64_t now = loop::now();
+
+            while (loop::now() < now + 2)
+                ;
+
+            t = clock_ns();
+            session::update_all();
+            iface::flush_all();
+
+            if (i > 0)
+                ns += clock_ns() - t;
+        }
+
+        snprintf(name, sizeof(name), "session::update_all tick (%d)", n);
+        report(name, TICKS, ns);
+
+        report("  per expired session", (uint64_t)TICKS * n, ns);
+
+        remove_sessions(pr);
+    }
+}
+
+struct benchmark {
+    const char* name;
+    void (*fn)();
+};
+
+static const benchmark benchmarks[] = {
+    { "address",  bench_address },
+    { "rules",    bench_rules },
+    { "sessions", bench_sessions },
+    { "timers",   bench_timers }
+};
+
+static const size_t benchmark_count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+
+int main(int argc, char* argv[])
+{
+    logger::verbosity(LOG_WARNING);
+
+    iface::sender(discard);
+
+    for (int i = 1; i < argc; i++) {
+        size_t b;
+
+        for (b = 0; (b < benchmark_count) && strcmp(argv[i], benchmarks[b].name); b++)
+            ;
+
+        if (b == benchmark_count) {
+            fprintf(stderr, "Usage: ndppd-microbench [address] [rules] [sessions] [timers]\n");
+            return 1;
+        }
+    }
+
+    printf("%-32s %12s %12s\n", "benchmark", "ops", "ns/op");
+
+    for (size_t b = 0; b < benchmark_count; b++) {
+        bool run = (argc == 1);
+
+        for (int i = 1; i < argc; i++) {
+            if (!strcmp(argv[i], benchmarks[b].name))
+                run = true;
+        }
+
+        if (run)
+            benchmarks[b].fn();
+    }
+
+    return 0;
+}
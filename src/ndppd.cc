@@ -20,16 +20,21 @@
 #include <fstream>
 #include <string>
 #include <memory>
+#include <vector>
 
 #include <getopt.h>
-#include <sys/time.h>
+#include <signal.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
 #include <unistd.h>
 
 #include "ndppd.h"
 #include "route.h"
+#include "control.h"
+#include "metrics.h"
 
 using namespace ndppd;
 
@@ -64,6 +69,53 @@ static int daemonize()
     return 0;
 }
 
+// Process IDs of the workers we forked.
+static std::vector<pid_t> workers;
+
+// Forks 'count - 1' worker processes. Returns the index of the worker
+// we've become, 0 being the parent, or -1 on error.
+static int spawn_workers(int count)
+{
+    iface::workers(count);
+
+    for (int i = 1; i < count; i++) {
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            logger::error() << "Failed to fork worker: " << logger::err();
+            return -1;
+        }
+
+        if (pid == 0) {
+            workers.clear();
+
+            // Don't outlive the parent.
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+            if (getppid() == 1)
+                exit(0);
+
+            iface::worker(i);
+            return i;
+        }
+
+        workers.push_back(pid);
+    }
+
+    return 0;
+}
+
+static void stop_workers()
+{
+    for (std::vector<pid_t>::iterator it = workers.begin(); it != workers.end(); it++)
+        kill(*it, SIGTERM);
+
+    for (std::vector<pid_t>::iterator it = workers.begin(); it != workers.end(); it++)
+        waitpid(*it, NULL, 0);
+
+    workers.clear();
+}
+
 static ptr<conf> load_config(const std::string& path)
 {
     ptr<conf> cf, x_cf;
@@ -146,6 +198,11 @@ static bool configure(ptr<conf>& cf)
         address::ttl(30000);
     else
         address::ttl(*x_cf);
+
+    if (!(x_cf = cf->find("poll-budget")))
+        iface::budget(256);
+    else
+        iface::budget(*x_cf);
     
     std::list<ptr<rule> > myrules;
 
@@ -166,7 +223,19 @@ static bool configure(ptr<conf>& cf)
         else
             promiscuous = *x_cf;
 
-        ptr<proxy> pr = proxy::open(*pr_cf, promiscuous);
+        bool ring = false;
+        if (!(x_cf = pr_cf->find("packet-ring")))
+            ring = false;
+        else
+            ring = *x_cf;
+
+        bool solicited_node = false;
+        if (!(x_cf = pr_cf->find("solicited-node")))
+            solicited_node = false;
+        else
+            solicited_node = *x_cf;
+
+        ptr<proxy> pr = proxy::open(*pr_cf, promiscuous, ring, solicited_node);
         if (!pr || pr.is_null() == true) {
             return false;
         }
@@ -185,6 +254,28 @@ static bool configure(ptr<conf>& cf)
             pr->keepalive(true);
         else
             pr->keepalive(*x_cf);
+
+        if (!(x_cf = pr_cf->find("offload")))
+            pr->offload(false);
+        else
+            pr->offload(*x_cf);
+
+        if (!(x_cf = pr_cf->find("raw-advert")))
+            pr->raw_advert(false);
+        else
+            pr->raw_advert(*x_cf);
+
+        if ((x_cf = pr_cf->find("xdp")) && (bool)*x_cf) {
+            // Solicits that go to the AF_XDP sockets never reach the
+            // kernel, so it couldn't answer for the offloaded sessions.
+            if (pr->offload()) {
+                logger::warning() << "Can't use XDP together with offload on interface '" << pr->ifa()->name() << "'";
+            } else if (iface::workers() > 1) {
+                logger::warning() << "Can't use XDP together with workers on interface '" << pr->ifa()->name() << "'";
+            } else if (!pr->ifa()->open_xdp()) {
+                logger::warning() << "Failed to attach XDP program to interface '" << pr->ifa()->name() << "', falling back to PF_PACKET";
+            }
+        }
         
         if (!(x_cf = pr_cf->find("retries")))
             pr->retries(3);
@@ -239,6 +330,10 @@ static bool configure(ptr<conf>& cf)
         }
     }
     
+    // Now that we know what the rules are, only let through the solicits
+    // that match them.
+    iface::update_filters();
+
     // Print out all the topology    
     for (std::map<std::string, weak_ptr<iface> >::iterator i_it = iface::_map.begin(); i_it != iface::_map.end(); i_it++) {
         ptr<iface> ifa = i_it->second;
@@ -284,16 +379,40 @@ static bool configure(ptr<conf>& cf)
 
 static bool running = true;
 
+static bool dump = false;
+
 static void exit_ndppd(int sig)
 {
     logger::error() << "Shutting down...";
     running = 0;
 }
 
+static void dump_ndppd(int sig)
+{
+    dump = true;
+}
+
+// Logs the counters of all interfaces, proxies and rules.
+static void dump_counters()
+{
+    logger::notice() << "Counters of worker " << iface::worker() << ":";
+
+    std::vector<std::string> lines;
+    control::stats(lines);
+
+    for (std::vector<std::string>::iterator it = lines.begin(); it != lines.end(); it++)
+        logger::notice() << *it;
+
+    // The workers keep counters of their own.
+    for (std::vector<pid_t>::iterator it = workers.begin(); it != workers.end(); it++)
+        kill(*it, SIGUSR1);
+}
+
 int main(int argc, char* argv[], char* env[])
 {
     signal(SIGINT, exit_ndppd);
     signal(SIGTERM, exit_ndppd);
+    signal(SIGUSR1, dump_ndppd);
 
     std::string config_path("/etc/ndppd.conf");
     std::string pidfile;
@@ -358,57 +477,142 @@ int main(int argc, char* argv[], char* env[])
             return 1;
     }
 
-    if (!configure(cf))
+    // Each worker reads its own share of the solicits, and has its own
+    // sessions. Workers are processes rather than threads, since they
+    // then need nothing in common once configured.
+
+    int count = 1;
+
+    ptr<conf> x_cf;
+
+    if ((x_cf = cf->find("workers")))
+        count = *x_cf;
+
+    if (count > 1) {
+        int index = spawn_workers(count);
+
+        if (index < 0) {
+            stop_workers();
+            return 1;
+        }
+
+        if (index > 0)
+            logger::notice() << "Started worker " << index;
+    }
+
+    if (!configure(cf)) {
+        stop_workers();
         return -1;
+    }
 
-    if (!pidfile.empty()) {
+    if (!pidfile.empty() && !iface::worker()) {
         std::ofstream pf;
         pf.open(pidfile.c_str(), std::ios::out | std::ios::trunc);
         pf << getpid() << std::endl;
         pf.close();
     }
 
-    // Time stuff.
+    // Only let SIGINT, SIGTERM and SIGUSR1 through while we're waiting for
+    // events, so that we can't miss one between checking 'running' (or
+    // 'dump') and sleeping.
 
-    struct timeval t1, t2;
+    sigset_t sigmask, orig_sigmask;
 
-    gettimeofday(&t1, 0);
+    sigemptyset(&sigmask);
+    sigaddset(&sigmask, SIGINT);
+    sigaddset(&sigmask, SIGTERM);
+    sigaddset(&sigmask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &sigmask, &orig_sigmask);
+
+    if (!loop::init())
+        return -1;
+
+    // Time stuff.
+
+    uint64_t t1 = loop::now(), t2;
 
 #ifdef WITH_ND_NETLINK
     netlink_setup();
 #endif
 
-    while (running) {
-        if (iface::poll_all() < 0) {
-            if (running) {
-                logger::error() << "iface::poll_all() failed";
-            }
-            break;
+    iface::watch();
+
+    if (rule::any_auto())
+        route::watch();
+
+    // Local addresses are needed to answer for those on the rule
+    // interfaces, to keep them out of XDP, and to send raw adverts from.
+    bool local_addresses = rule::any_iface() || iface::any_xdp() || proxy::any_raw_advert();
+
+    if (local_addresses)
+        address::watch();
+
+    // Every worker has its own control socket, since they each have
+    // sessions of their own.
+
+    if ((x_cf = cf->find("control"))) {
+        std::string path = *x_cf;
+
+        if (iface::worker())
+            path += logger::format(".%d", iface::worker());
+
+        if (!control::open(path)) {
+            stop_workers();
+            return -1;
         }
+    }
 
+    if ((x_cf = cf->find("metrics")) && !metrics::open(*x_cf)) {
+        stop_workers();
+        return -1;
+    }
+
+    while (running) {
         int elapsed_time;
-        gettimeofday(&t2, 0);
+        t2 = loop::now();
 
-        elapsed_time =
-            ((t2.tv_sec  - t1.tv_sec)*   1000) +
-            ((t2.tv_usec - t1.tv_usec) / 1000);
+        elapsed_time = (int)(t2 - t1);
 
-        t1.tv_sec  = t2.tv_sec;
-        t1.tv_usec = t2.tv_usec;
+        t1 = t2;
 
         if (rule::any_auto())
             route::update(elapsed_time);
         
-        if (rule::any_iface())
+        // Rules added through the control socket may need them too.
+        local_addresses = local_addresses || rule::any_iface();
+
+        if (local_addresses)
             address::update(elapsed_time);
 
-        session::update_all(elapsed_time);
+        session::update_all();
+
+        if (dump) {
+            dump = false;
+            dump_counters();
+        }
+
+        // Send everything that was queued since the last iteration.
+        iface::flush_all();
+
+        // Sleep until a packet arrives or until the next deadline.
+        if (loop::poll(&orig_sigmask) < 0) {
+            if (running) {
+                logger::error() << "loop::poll() failed";
+            }
+            break;
+        }
     }
 
 #ifdef WITH_ND_NETLINK
     netlink_teardown();
 #endif
 
+    control::close();
+
+    metrics::close();
+
+    stop_workers();
+
     logger::notice() << "Bye";
 
     return 0;
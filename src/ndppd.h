@@ -30,6 +30,14 @@
 #include "logger.h"
 #include "conf.h"
 #include "address.h"
+#include "trie.h"
+#include "address_map.h"
+#include "loop.h"
+#include "timer.h"
+#include "rtnl.h"
+#include "xdp.h"
+#include "counters.h"
+#include "histogram.h"
 
 #include "iface.h"
 #include "proxy.h"
@@ -32,8 +32,15 @@ static address all_nodes = address("ff02::1");
 std::list<ptr<proxy> > proxy::_list;
 
 proxy::proxy() :
-    _router(true), _ttl(30000), _deadtime(3000), _timeout(500), _autowire(false), _keepalive(true), _promiscuous(false), _retries(3)
+    _router(true), _ttl(30000), _deadtime(3000), _timeout(500), _autowire(false), _keepalive(true), _offload(false), _raw_advert(false), _promiscuous(false), _retries(3),
+    _stats(new counters())
 {
+    memset(_session_counts, 0, sizeof(_session_counts));
+}
+
+proxy::~proxy()
+{
+    delete _stats;
 }
 
 ptr<proxy> proxy::find_aunt(const std::string& ifname, const address& taddr)
@@ -43,21 +50,10 @@ ptr<proxy> proxy::find_aunt(const std::string& ifname, const address& taddr)
     {
         ptr<proxy> pr = (*sit);
         
-        bool has_addr = false;
-        for (std::list<ptr<rule> >::iterator it = pr->_rules.begin(); it != pr->_rules.end(); it++) {
-            ptr<rule> ru = *it;
-            
-            if (ru->addr() == taddr) {
-                has_addr = true;
-                break;
-            }
-        }
-        
-        if (has_addr == false) {
+        if (!pr->ifa() || pr->ifa()->name() != ifname)
             continue;
-        }
         
-        if (pr->ifa() && pr->ifa()->name() == ifname)
+        if (pr->_rule_trie.find(taddr))
             return pr;
     }
     
@@ -80,9 +76,9 @@ ptr<proxy> proxy::create(const ptr<iface>& ifa, bool promiscuous)
     return pr;
 }
 
-ptr<proxy> proxy::open(const std::string& ifname, bool promiscuous)
+ptr<proxy> proxy::open(const std::string& ifname, bool promiscuous, bool ring, bool solicited_node)
 {
-    ptr<iface> ifa = iface::open_pfd(ifname, promiscuous);
+    ptr<iface> ifa = iface::open_pfd(ifname, promiscuous, ring, solicited_node);
 
     if (!ifa) {
         return ptr<proxy>();
@@ -93,68 +89,71 @@ ptr<proxy> proxy::open(const std::string& ifname, bool promiscuous)
 
 ptr<session> proxy::find_or_create_session(const address& taddr)
 {
-    // Let's check this proxy's list of sessions to see if we can
-    // find one with the same target address.
+    // Let's check this proxy's sessions to see if we can find one
+    // with the same target address.
 
-    for (std::list<ptr<session> >::iterator sit = _sessions.begin();
-            sit != _sessions.end(); sit++) {
-        
-        if ((*sit)->taddr() == taddr)
-            return (*sit);
-    }
+    ptr<session>* sep = _sessions.find(taddr);
+
+    if (sep)
+        return *sep;
     
     ptr<session> se;
     
     // Since we couldn't find a session that matched, we'll try to find
     // a matching rule instead, and then set up a new session.
     
-    for (std::list<ptr<rule> >::iterator it = _rules.begin();
-            it != _rules.end(); it++) {
+    std::vector<ptr<rule> > rules;
+    find_rules(taddr, rules);
+
+    for (std::vector<ptr<rule> >::iterator it = rules.begin();
+            it != rules.end(); it++) {
         ptr<rule> ru = *it;
 
-        logger::debug() << "checking " << ru->addr() << " against " << taddr;
+        logger::debug() << "rule " << ru->addr() << " matches " << taddr;
 
-        if (ru->addr() == taddr) {
-            if (!se) {
-                se = session::create(_ptr, taddr, _autowire, _keepalive, _retries);
-            }
-            
-            if (ru->is_auto()) {
-                ptr<route> rt = route::find(taddr);
+        if (!se) {
+            se = session::create(_ptr, ru, taddr, _autowire, _keepalive, _retries);
+            _stats->sessions_created++;
+            ru->stats().sessions_created++;
+        }
+        
+        if (ru->is_auto()) {
+            ptr<route> rt = route::find(taddr);
 
-                if (rt->ifname() == _ifa->name()) {
-                    logger::debug() << "skipping route since it's using interface " << rt->ifname();
-                } else {
-                    ptr<iface> ifa = rt->ifa();
+            if (!rt) {
+                logger::debug() << "no route to " << taddr;
+            } else if (rt->ifname() == _ifa->name()) {
+                logger::debug() << "skipping route since it's using interface " << rt->ifname();
+            } else {
+                ptr<iface> ifa = rt->ifa();
 
-                    if (ifa && (ifa != ru->daughter())) {
-                        se->add_iface(ifa);
-                    }
+                if (ifa && (ifa != ru->daughter())) {
+                    se->add_iface(ifa);
                 }
-            } else if (!ru->daughter()) {
-                // This rule doesn't have an interface, and thus we'll consider
-                // it "static" and immediately send the response.
-                se->handle_advert();
-                return se;
-                
-            } else {
-                
-                ptr<iface> ifa = ru->daughter();
-                se->add_iface(ifa);
+            }
+        } else if (!ru->daughter()) {
+            // This rule doesn't have an interface, and thus we'll consider
+            // it "static" and immediately send the response.
+            se->handle_advert();
+            return se;
+            
+        } else {
+            
+            ptr<iface> ifa = ru->daughter();
+            se->add_iface(ifa);
      
-                #ifdef WITH_ND_NETLINK
-                if (if_addr_find(ifa->name(), &taddr.const_addr())) {
-                    logger::debug() << "Sending NA out " << ifa->name();
-                    se->add_iface(_ifa);
-                    se->handle_advert();
-                }
-                #endif
+            #ifdef WITH_ND_NETLINK
+            if (if_addr_find(ifa->name(), &taddr.const_addr())) {
+                logger::debug() << "Sending NA out " << ifa->name();
+                se->add_iface(_ifa);
+                se->handle_advert();
             }
+            #endif
         }
     }
     
     if (se) {
-        _sessions.push_back(se);
+        _sessions.insert(taddr, se);
     }
     
     return se;
@@ -163,14 +162,12 @@ ptr<session> proxy::find_or_create_session(const address& taddr)
 void proxy::handle_advert(const address& saddr, const address& taddr, const std::string& ifname, bool use_via)
 {
     // If a session exists then process the advert in the context of the session
-    for (std::list<ptr<session> >::iterator s_it = _sessions.begin();
-            s_it != _sessions.end(); s_it++)
-    {
-        const ptr<session> sess = *s_it;
+    ptr<session>* sep = _sessions.find(taddr);
 
-        if ((sess->taddr() == taddr)) {
-            sess->handle_advert(saddr, ifname, use_via);
-        }
+    if (sep) {
+        // Hold on to the session; handling the advert may remove it.
+        ptr<session> sess = *sep;
+        sess->handle_advert(saddr, ifname, use_via);
     }
 }
 
@@ -187,14 +184,25 @@ void proxy::handle_stateless_advert(const address& saddr, const address& taddr,
     }
 }
 
-void proxy::handle_solicit(const address& saddr, const address& taddr, const std::string& ifname)
+void proxy::handle_solicit(const address& saddr, const address& taddr, const std::string& ifname,
+                           const struct ether_addr& lladdr, uint64_t stamp)
 {
     logger::debug()
         << "proxy::handle_solicit()";
+
+    _stats->ns_rx++;
     
     // Otherwise find or create a session to scan for this address
     ptr<session> se = find_or_create_session(taddr);
-    if (!se) return;
+    if (!se) {
+        _stats->ignored++;
+        return;
+    }
+
+    ptr<rule> ru = se->ru();
+
+    if (ru)
+        ru->stats().ns_rx++;
     
     // Touching the session will cause an NDP advert to be transmitted to all
     // the daughters
@@ -206,12 +214,25 @@ void proxy::handle_solicit(const address& saddr, const address& taddr, const std
         switch (se->status()) {
             case session::WAITING:
             case session::INVALID:
-                se->add_pending(saddr);
+                se->add_pending(saddr, lladdr, stamp);
                 break;
 
             case session::VALID:
             case session::RENEWING:
-                se->send_advert(saddr);
+                // Once the kernel has a proxy neighbor entry for the
+                // target it answers by itself.
+                if (se->offloaded())
+                    break;
+
+                se->send_advert(saddr, lladdr, stamp, false);
+
+                // Only hand over sessions that we keep around.
+                if (_offload) {
+                    ptr<session>* sep = _sessions.find(taddr);
+
+                    if (sep && (*sep == se))
+                        se->offload();
+                }
                 break;
         }
      }
@@ -222,6 +243,7 @@ ptr<rule> proxy::add_rule(const address& addr, const ptr<iface>& ifa, bool autov
     ptr<rule> ru(rule::create(_ptr, addr, ifa));
     ru->autovia(autovia);
     _rules.push_back(ru);
+    _rule_trie.insert(addr, ru);
     return ru;
 }
 
@@ -229,9 +251,35 @@ ptr<rule> proxy::add_rule(const address& addr, bool aut)
 {
     ptr<rule> ru(rule::create(_ptr, addr, aut));
     _rules.push_back(ru);
+    _rule_trie.insert(addr, ru);
     return ru;
 }
 
+bool proxy::remove_rule(const address& addr)
+{
+    std::vector<ptr<rule> > rules;
+    _rule_trie.find_exact(addr, rules);
+
+    if (rules.empty())
+        return false;
+
+    ptr<rule> ru = rules.front();
+
+    _rule_trie.remove(addr, ru);
+    _rules.remove(ru);
+
+    flush_sessions(ru);
+
+    logger::debug() << "proxy::remove_rule() if=" << (_ifa ? _ifa->name() : "null") << ", addr=" << addr;
+
+    return true;
+}
+
+void proxy::find_rules(const address& taddr, std::vector<ptr<rule> >& rules) const
+{
+    _rule_trie.find_all(taddr, rules);
+}
+
 std::list<ptr<rule> >::iterator proxy::rules_begin()
 {
     return _rules.begin();
@@ -244,7 +292,78 @@ std::list<ptr<rule> >::iterator proxy::rules_end()
 
 void proxy::remove_session(const ptr<session>& se)
 {
-    _sessions.remove(se);
+    ptr<session>* sep = _sessions.find(se->taddr());
+
+    if (sep && (*sep == se))
+        _sessions.remove(se->taddr());
+}
+
+counters& proxy::stats()
+{
+    return *_stats;
+}
+
+void proxy::sessions(std::vector<ptr<session> >& sessions) const
+{
+    _sessions.values(sessions);
+}
+
+int proxy::flush_sessions(const address& prefix)
+{
+    std::vector<ptr<session> > sessions;
+    _sessions.values(sessions);
+
+    int count = 0;
+
+    for (std::vector<ptr<session> >::iterator it = sessions.begin(); it != sessions.end(); it++) {
+        if (prefix == (*it)->taddr()) {
+            remove_session(*it);
+            count++;
+        }
+    }
+
+    return count;
+}
+
+int proxy::flush_sessions(const ptr<rule>& ru)
+{
+    std::vector<ptr<session> > sessions;
+    _sessions.values(sessions);
+
+    int count = 0;
+
+    for (std::vector<ptr<session> >::iterator it = sessions.begin(); it != sessions.end(); it++) {
+        if ((*it)->ru() == ru) {
+            remove_session(*it);
+            count++;
+        }
+    }
+
+    return count;
+}
+
+histogram& proxy::hit_latency()
+{
+    return _hit_latency;
+}
+
+histogram& proxy::discovery_latency()
+{
+    return _discovery_latency;
+}
+
+void proxy::count_session(int from, int to)
+{
+    if ((from >= 0) && (from < 4))
+        _session_counts[from]--;
+
+    if ((to >= 0) && (to < 4))
+        _session_counts[to]++;
+}
+
+int proxy::session_count(int status) const
+{
+    return ((status >= 0) && (status < 4)) ? _session_counts[status] : 0;
 }
 
 const ptr<iface>& proxy::ifa() const
@@ -297,6 +416,41 @@ void proxy::keepalive(bool val)
     _keepalive = val;
 }
 
+bool proxy::offload() const
+{
+    return _offload;
+}
+
+void proxy::offload(bool val)
+{
+    if (val && (!_ifa || !_ifa->forwarding() || !_ifa->proxy_ndp() || !rtnl::open())) {
+        logger::error() << "Unable to offload sessions to the kernel; offload disabled";
+        val = false;
+    }
+
+    _offload = val;
+}
+
+bool proxy::raw_advert() const
+{
+    return _raw_advert;
+}
+
+void proxy::raw_advert(bool val)
+{
+    _raw_advert = val;
+}
+
+bool proxy::any_raw_advert()
+{
+    for (std::list<ptr<proxy> >::iterator it = _list.begin(); it != _list.end(); it++) {
+        if ((*it)->_raw_advert)
+            return true;
+    }
+
+    return false;
+}
+
 int proxy::ttl() const
 {
     return _ttl;
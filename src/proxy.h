@@ -28,13 +28,15 @@ NDPPD_NS_BEGIN
 class iface;
 class rule;
 
-class proxy {
+class proxy : public refcounted {
 public:    
     static ptr<proxy> create(const ptr<iface>& ifa, bool promiscuous);
+
+    ~proxy();
     
     static ptr<proxy> find_aunt(const std::string& ifname, const address& taddr);
 
-    static ptr<proxy> open(const std::string& ifn, bool promiscuous);
+    static ptr<proxy> open(const std::string& ifn, bool promiscuous, bool ring = false, bool solicited_node = false);
     
     ptr<session> find_or_create_session(const address& taddr);
     
@@ -42,14 +44,34 @@ public:
     
     void handle_stateless_advert(const address& saddr, const address& taddr, const std::string& ifname, bool use_via);
     
-    void handle_solicit(const address& saddr, const address& taddr, const std::string& ifname);
+    // Handles a solicit received at 'stamp' (see loop::stamp()).
+    void handle_solicit(const address& saddr, const address& taddr, const std::string& ifname,
+                        const struct ether_addr& lladdr, uint64_t stamp);
 
     void remove_session(const ptr<session>& se);
 
+    // Appends all sessions of this proxy to 'sessions'.
+    void sessions(std::vector<ptr<session> >& sessions) const;
+
+    // Removes the sessions for targets within 'prefix'. Returns the
+    // number of sessions removed.
+    int flush_sessions(const address& prefix);
+
+    // Removes the sessions that were created for 'ru'.
+    int flush_sessions(const ptr<rule>& ru);
+
     ptr<rule> add_rule(const address& addr, const ptr<iface>& ifa, bool autovia);
 
     ptr<rule> add_rule(const address& addr, bool aut = false);
+
+    // Removes the rule for exactly 'addr' (address and mask), along with
+    // its sessions. Returns false if there is no such rule.
+    bool remove_rule(const address& addr);
     
+    // Appends the rules that match 'taddr' to 'rules', in the order
+    // they were added.
+    void find_rules(const address& taddr, std::vector<ptr<rule> >& rules) const;
+
     std::list<ptr<rule> >::iterator rules_begin();
     
     std::list<ptr<rule> >::iterator rules_end();
@@ -74,6 +96,21 @@ public:
 
     void keepalive(bool val);
 
+    bool offload() const;
+
+    // Turns on kernel offload of sessions, which requires proxy_ndp on the
+    // interface and a netlink socket. Stays off if either can't be had.
+    void offload(bool val);
+
+    bool raw_advert() const;
+
+    // Sends adverts as complete Ethernet frames straight to the link-layer
+    // address of the solicitor, rather than through the ICMPv6 socket.
+    void raw_advert(bool val);
+
+    // Returns true if any proxy sends raw adverts.
+    static bool any_raw_advert();
+
     int timeout() const;
 
     void timeout(int val);
@@ -86,6 +123,24 @@ public:
 
     void deadtime(int val);
 
+    // Returns the counters of this proxy.
+    counters& stats();
+
+    // Time in nanoseconds from receiving a solicit to answering it, for
+    // targets that had a valid session, and for those that had to be
+    // solicited on a daughter interface first.
+    histogram& hit_latency();
+
+    histogram& discovery_latency();
+
+    // Moves one session of this proxy from state 'from' to state 'to'
+    // (session::WAITING, ...) in the counts returned by session_count().
+    // -1 stands for a session that doesn't exist (yet, or anymore).
+    void count_session(int from, int to);
+
+    // Returns the number of sessions of this proxy in state 'status'.
+    int session_count(int status) const;
+
 private:
     static std::list<ptr<proxy> > _list;
 
@@ -95,7 +150,11 @@ private:
 
     std::list<ptr<rule> > _rules;
 
-    std::list<ptr<session> > _sessions;
+    // The rules above, indexed by prefix.
+    trie<ptr<rule> > _rule_trie;
+
+    // Sessions indexed by target address.
+    address_map<ptr<session> > _sessions;
     
     bool _promiscuous;
 
@@ -107,8 +166,20 @@ private:
     
     bool _keepalive;
 
+    bool _offload;
+
+    bool _raw_advert;
+
     int _ttl, _deadtime, _timeout;
 
+    counters* _stats;
+
+    histogram _hit_latency, _discovery_latency;
+
+    // Sessions by state, kept up to date as they change so that nobody
+    // has to go through all of them to know.
+    int _session_counts[4];
+
     proxy();
 };
 
@@ -16,6 +16,9 @@
 #pragma once
 
 #include <exception>
+#include <new>
+
+#include <stddef.h>
 
 #include "ndppd.h"
 #include "logger.h"
@@ -30,6 +33,55 @@ public:
 template <class T>
 class weak_ptr;
 
+// The weak and strong reference counts of an object managed by ptr<>.
+// Objects of classes derived from refcounted have it in front of them,
+// in the same allocation; for anything else it's allocated on its own.
+struct ptr_ref {
+    void* ptr;
+    int wc, sc;
+    bool embedded;
+};
+
+// Base class for objects that keep their reference counts in the same
+// allocation as themselves. That saves an allocation per object, and
+// the counts share a cache line with the start of the object, so going
+// through a ptr<> to it doesn't cost an extra cache miss.
+//
+// Such objects must be allocated with new, and handed to a ptr<> as the
+// type they were allocated as. Their memory is freed once the last weak
+// reference is gone, which may be well after they've been destroyed.
+class refcounted {
+public:
+    static void* operator new(size_t size)
+    {
+        ptr_ref* ref = (ptr_ref* )::operator new(HEADER_SIZE + size);
+
+        ref->ptr      = 0;
+        ref->wc       = 0;
+        ref->sc       = 0;
+        ref->embedded = true;
+
+        return (char* )ref + HEADER_SIZE;
+    }
+
+    static void operator delete(void* p)
+    {
+        if (p) {
+            ::operator delete(header(p));
+        }
+    }
+
+    // Returns the counts in front of the object at 'p'.
+    static ptr_ref* header(void* p)
+    {
+        return (ptr_ref* )((char* )p - HEADER_SIZE);
+    }
+
+private:
+    // Keeps the object as aligned as what operator new returns.
+    enum { HEADER_SIZE = (sizeof(ptr_ref) + 15) & ~15 };
+};
+
 // This template class simplifies the usage of pointers. It's basically
 // a reference-counting smart pointer that supports both weak and
 // strong references.
@@ -39,11 +91,6 @@ class ptr {
     template <typename U>
     friend class ptr;
 
-    struct ptr_ref {
-        T* ptr;
-        int wc, sc;
-    };
-
 protected:
     bool _weak;
 
@@ -68,14 +115,46 @@ protected:
         }
     }
 
-    void acquire(void* ptr)
+    void acquire(T* p)
     {
-        if (!ptr) return;
+        ptr_ref* ref = 0;
+
+        if (p) {
+            ref = make_ref(p, p);
 
-        _ref      = new ptr_ref();
-        _ref->ptr = (T*)ptr;
-        _ref->wc  = !!_weak;
-        _ref->sc  = !_weak;
+            if (!ref->ptr) {
+                ref->ptr = p;
+            } else if (!ref->sc) {
+                throw new invalid_pointer;
+            }
+
+            if (_weak) {
+                ref->wc++;
+            } else {
+                ref->sc++;
+            }
+        }
+
+        release();
+
+        _ref = ref;
+    }
+
+    // Returns the counts of 'p', which objects derived from refcounted
+    // already have.
+    static ptr_ref* make_ref(T* p, const refcounted* )
+    {
+        return refcounted::header(p);
+    }
+
+    static ptr_ref* make_ref(T* p, const void* )
+    {
+        ptr_ref* ref  = new ptr_ref();
+        ref->ptr      = 0;
+        ref->wc       = 0;
+        ref->sc       = 0;
+        ref->embedded = false;
+        return ref;
     }
 
     void release()
@@ -95,22 +174,27 @@ protected:
         } else {
             assert(_ref->sc > 0);
             if (!--_ref->sc && _ref->ptr) {
-                T* ptr = _ref->ptr;
+                T* ptr = static_cast<T* >(_ref->ptr);
                 _ref->ptr = 0;
                 _ref->wc++;
-                delete ptr;
+
+                // The memory of an embedded object goes with the counts.
+                if (_ref->embedded) {
+                    ptr->~T();
+                } else {
+                    delete ptr;
+                }
+
                 _ref->wc--;
             }
         }
 
-        /*if (!_weak && !_ref->sc && _ref->ptr) {
-            T* ptr = (T*)(_ref->ptr);
-            _ref->ptr = 0;
-            delete ptr;
-        }*/
-
         if (!_ref->sc && !_ref->wc) {
-            delete _ref;
+            if (_ref->embedded) {
+                ::operator delete(_ref);
+            } else {
+                delete _ref;
+            }
         }
 
         _ref = 0;
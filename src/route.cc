@@ -13,21 +13,34 @@
 //
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <cstring>
 #include <list>
 #include <memory>
 #include <fstream>
 
+#include <errno.h>
+#include <net/if.h>
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
 #include "ndppd.h"
 #include "route.h"
 
 NDPPD_NS_BEGIN
 
-std::list<ptr<route> > route::_routes;
+trie<ptr<route> > route::_routes;
 
 int route::_ttl;
 
 int route::_c_ttl;
 
+bool route::_netlink;
+
+bool route::_dumping;
+
+trie<ptr<route> > route::_dump_routes;
+
 route::route(const address& addr, const std::string& ifname) :
     _addr(addr), _ifname(ifname)
 {
@@ -81,9 +94,9 @@ std::string route::token(const char* str)
 
 void route::load(const std::string& path)
 {
-    // Hack to make sure the interfaces are not freed prematurely.
-    std::list<ptr<route> > tmp_routes(_routes);
-    _routes.clear();
+    // Load the routes on the side, so that lookups never see a table
+    // that's only partially loaded.
+    trie<ptr<route> > routes;
 
     logger::debug() << "reading routes";
 
@@ -117,39 +130,171 @@ void route::load(const std::string& path)
 
             addr.prefix((int)pfx);
 
-            route::create(addr, route::token(buf + 141));
+            add(routes, addr, route::token(buf + 141));
         }
     } catch (std::ifstream::failure e) {
         logger::warning() << "Failed to parse IPv6 routing data from '" << path << "'";
         logger::error() << e.what();
+        return;
+    }
+
+    _routes.swap(routes);
+}
+
+void route::add(trie<ptr<route> >& routes, const address& addr, const std::string& ifname)
+{
+    std::vector<ptr<route> > same;
+    routes.find_exact(addr, same);
+
+    for (std::vector<ptr<route> >::iterator it = same.begin(); it != same.end(); it++) {
+        if ((*it)->_ifname == ifname)
+            return;
+    }
+
+    routes.insert(addr, ptr<route>(new route(addr, ifname)));
+}
+
+bool route::watch()
+{
+    rtnl::watch(RTM_NEWROUTE, route::handle_rtnl);
+    rtnl::watch(RTM_DELROUTE, route::handle_rtnl);
+
+    // Join the group before dumping, so that no change falls in between.
+
+    if (!rtnl::subscribe(RTNLGRP_IPV6_ROUTE, route::resync)) {
+        logger::warning() << "Unable to monitor routes, falling back to reading /proc/net/ipv6_route";
+        return false;
+    }
+
+    _netlink = true;
+
+    resync();
+
+    return _netlink;
+}
+
+void route::resync()
+{
+    _dumping = true;
+    _dump_routes.clear();
+
+    if (!rtnl::dump(RTM_GETROUTE, AF_INET6, route::handle_dump))
+        handle_dump(0, EIO, NULL);
+}
+
+void route::handle_dump(uint32_t seq, int error, void* data)
+{
+    // Superseded by a later resync(); its dump will fill _dump_routes
+    // from scratch.
+    if (error == ECANCELED) {
+        _dump_routes.clear();
+        return;
+    }
+
+    _dumping = false;
+
+    if (error) {
+        logger::warning()
+            << "Failed to dump routes (" << strerror(error)
+            << "), falling back to reading /proc/net/ipv6_route";
+
+        _dump_routes.clear();
+        _netlink = false;
+        _c_ttl   = 0;
+
+        loop::wakeup_in(0);
+        return;
+    }
+
+    _routes.swap(_dump_routes);
+    _dump_routes.clear();
+
+    logger::debug() << "route::handle_dump() " << _routes.size() << " routes";
+}
+
+void route::handle_rtnl(const struct nlmsghdr* nlh)
+{
+    const struct rtmsg* rtm = (const struct rtmsg* )NLMSG_DATA(nlh);
+
+    if ((nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*rtm))) || (rtm->rtm_family != AF_INET6))
+        return;
+
+    int len = RTM_PAYLOAD(nlh);
+
+    address addr;
+    int ifindex = 0;
+
+    for (const struct rtattr* rta = RTM_RTA(rtm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        switch (rta->rta_type) {
+        case RTA_DST:
+            memcpy(&addr.addr(), RTA_DATA(rta), sizeof(struct in6_addr));
+            break;
+
+        case RTA_OIF:
+            ifindex = *(const int* )RTA_DATA(rta);
+            break;
+        }
+    }
+
+    char ifname[IF_NAMESIZE];
+
+    // Routes without an interface (multipath, blackhole, ...) aren't
+    // listed in /proc/net/ipv6_route either.
+
+    if (!ifindex || !if_indextoname(ifindex, ifname))
+        return;
+
+    addr.prefix(rtm->rtm_dst_len);
+
+    trie<ptr<route> >& routes = _dumping ? _dump_routes : _routes;
+
+    if (nlh->nlmsg_type == RTM_NEWROUTE) {
+        if (!_dumping)
+            logger::debug() << "route::handle_rtnl() added " << addr << " dev " << ifname;
+
+        add(routes, addr, ifname);
+        return;
+    }
+
+    std::vector<ptr<route> > same;
+    routes.find_exact(addr, same);
+
+    for (std::vector<ptr<route> >::iterator it = same.begin(); it != same.end(); it++) {
+        if ((*it)->_ifname == ifname) {
+            logger::debug() << "route::handle_rtnl() removed " << addr << " dev " << ifname;
+            routes.remove(addr, *it);
+            return;
+        }
     }
 }
 
 void route::update(int elapsed_time)
 {
+    // Nothing to do; we hear about changes as they happen.
+    if (_netlink)
+        return;
+
     if ((_c_ttl -= elapsed_time) <= 0) {
         load("/proc/net/ipv6_route");
         _c_ttl = _ttl;
     }
+
+    loop::wakeup_in(_c_ttl);
 }
 
 ptr<route> route::create(const address& addr, const std::string& ifname)
 {
     ptr<route> rt(new route(addr, ifname));
     // logger::debug() << "route::create() addr=" << addr << ", ifname=" << ifname;
-    _routes.push_back(rt);
+    _routes.insert(addr, rt);
     return rt;
 }
 
 ptr<route> route::find(const address& addr)
 {
-    for (std::list<ptr<route> >::iterator it = _routes.begin();
-            it != _routes.end(); it++) {
-        if ((*it)->addr() == addr)
-            return *it;
-    }
+    const ptr<route>* rt = _routes.find(addr);
 
-    return ptr<route>();
+    return rt ? *rt : ptr<route>();
 }
 
 ptr<iface> route::find_and_open(const address& addr)
@@ -172,10 +317,10 @@ ptr<iface> route::ifa()
 {
     if (!_ifa) {
         logger::debug() << "router::ifa() opening interface '" << _ifname << "'";
-        return _ifa = iface::open_ifd(_ifname);
+        _ifa = iface::open_ifd(_ifname);
     }
 
-    return ptr<iface>();
+    return _ifa;
 }
 
 const address& route::addr() const
@@ -19,20 +19,30 @@
 #include <list>
 #include <memory>
 
+#include <stdint.h>
+#include <linux/netlink.h>
+
 #include "ndppd.h"
 
 NDPPD_NS_BEGIN
 
-class route {
+class route : public refcounted {
 public:
     static ptr<route> create(const address& addr, const std::string& ifname);
 
+    // Returns the most specific route to 'addr', or a null pointer if
+    // there is none.
     static ptr<route> find(const address& addr);
 
     static ptr<iface> find_and_open(const address& addr);
 
     static void load(const std::string& path);
 
+    // Starts keeping the routes up to date with an RTM_GETROUTE dump and
+    // RTNLGRP_IPV6_ROUTE notifications. Returns false if that can't be
+    // done, in which case update() keeps reloading /proc/net/ipv6_route.
+    static bool watch();
+
     static void update(int elapsed_time);
 
     static int ttl();
@@ -62,8 +72,26 @@ private:
 
     ptr<iface> _ifa;
 
-    static std::list<ptr<route> > _routes;
+    // Routes indexed by destination prefix.
+    static trie<ptr<route> > _routes;
+
+    // Whether the routes are kept up to date through netlink.
+    static bool _netlink;
+
+    // Whether a dump is in progress, and the routes it has returned so
+    // far. They replace _routes once the dump is complete.
+    static bool _dumping;
+
+    static trie<ptr<route> > _dump_routes;
+
+    // Adds a route to 'routes', unless it's already there.
+    static void add(trie<ptr<route> >& routes, const address& addr, const std::string& ifname);
+
+    static void resync();
+
+    static void handle_dump(uint32_t seq, int error, void* data);
 
+    static void handle_rtnl(const struct nlmsghdr* nlh);
 };
 
 NDPPD_NS_END
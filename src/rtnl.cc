@@ -0,0 +1,443 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <cstring>
+
+#include <unistd.h>
+#include <errno.h>
+
+#include <net/if.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/neighbour.h>
+
+#include "ndppd.h"
+#include "rtnl.h"
+
+NDPPD_NS_BEGIN
+
+int rtnl::_fd = -1;
+
+uint32_t rtnl::_seq;
+
+std::map<uint32_t, rtnl::request> rtnl::_requests;
+
+std::map<int, rtnl::handler> rtnl::_handlers;
+
+std::vector<void (*)()> rtnl::_resyncs;
+
+std::list<rtnl::dump_request> rtnl::_dumps;
+
+uint32_t rtnl::_dump_seq;
+
+// Room for a request header, its fixed-size message and a few attributes.
+
+union rtnl_request {
+    struct nlmsghdr nlh;
+    uint8_t buf[512];
+};
+
+static void add_attr(union rtnl_request& req, int type, const void* data, int len)
+{
+    struct nlmsghdr* nlh = &req.nlh;
+    struct rtattr* rta   = (struct rtattr* )(req.buf + NLMSG_ALIGN(nlh->nlmsg_len));
+
+    rta->rta_type = type;
+    rta->rta_len  = RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+
+    nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+bool rtnl::open()
+{
+    if (_fd >= 0)
+        return true;
+
+    if ((_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0) {
+        logger::error() << "Unable to create netlink socket: " << logger::err();
+        return false;
+    }
+
+    struct sockaddr_nl snl;
+
+    memset(&snl, 0, sizeof(snl));
+    snl.nl_family = AF_NETLINK;
+
+    // Route dumps and bursts of notifications can be large.
+    int rcvbuf = 1 << 20;
+    setsockopt(_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    if (bind(_fd, (struct sockaddr* )&snl, sizeof(snl)) < 0) {
+        logger::error() << "Failed to bind netlink socket: " << logger::err();
+        ::close(_fd);
+        _fd = -1;
+        return false;
+    }
+
+    if (!loop::add(_fd, rtnl::handle_event, NULL)) {
+        ::close(_fd);
+        _fd = -1;
+        return false;
+    }
+
+    logger::debug() << "rtnl::open() fd=" << _fd;
+
+    return true;
+}
+
+void rtnl::watch(int type, handler h)
+{
+    _handlers[type] = h;
+}
+
+bool rtnl::subscribe(int group, void (*resync)())
+{
+    if ((_fd < 0) && !open())
+        return false;
+
+    if (setsockopt(_fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, sizeof(group)) < 0) {
+        logger::error() << "Failed to join netlink group " << group << ": " << logger::err();
+        return false;
+    }
+
+    if (resync)
+        _resyncs.push_back(resync);
+
+    return true;
+}
+
+bool rtnl::dump(int type, int family, callback cb, void* data)
+{
+    if ((_fd < 0) && !open())
+        return false;
+
+    std::list<dump_request> superseded;
+
+    for (std::list<dump_request>::iterator it = _dumps.begin(); it != _dumps.end(); ) {
+        if ((it->type != type) || (it->family != family) || (it->cb != cb)) {
+            it++;
+        } else if (_dump_seq && (it == _dumps.begin())) {
+            // Already in progress; the kernel will finish it anyway.
+            it->superseded = true;
+            it++;
+        } else {
+            superseded.push_back(*it);
+            it = _dumps.erase(it);
+        }
+    }
+
+    dump_request dr;
+    dr.type       = type;
+    dr.family     = family;
+    dr.cb         = cb;
+    dr.data       = data;
+    dr.superseded = false;
+
+    _dumps.push_back(dr);
+
+    for (std::list<dump_request>::iterator it = superseded.begin(); it != superseded.end(); it++) {
+        if (it->cb)
+            it->cb(0, ECANCELED, it->data);
+    }
+
+    next_dump();
+
+    return true;
+}
+
+void rtnl::next_dump()
+{
+    while (!_dump_seq && !_dumps.empty()) {
+        dump_request& dr = _dumps.front();
+
+        union rtnl_request req;
+
+        memset(&req, 0, sizeof(req));
+
+        // The family is the first member of all of rtmsg, ifaddrmsg and
+        // friends, which is all the kernel looks at for a plain dump.
+
+        req.nlh.nlmsg_len   = NLMSG_LENGTH(sizeof(struct rtmsg));
+        req.nlh.nlmsg_type  = dr.type;
+        req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+
+        ((struct rtmsg* )NLMSG_DATA(&req.nlh))->rtm_family = dr.family;
+
+        logger::debug() << "rtnl::next_dump() type=" << dr.type << ", family=" << dr.family;
+
+        if (!(_dump_seq = send(&req.nlh)))
+            end_dump(errno ? errno : EIO);
+    }
+}
+
+void rtnl::end_dump(int error)
+{
+    dump_request dr = _dumps.front();
+
+    _dumps.pop_front();
+    _dump_seq = 0;
+
+    if (dr.cb)
+        dr.cb(0, dr.superseded ? ECANCELED : error, dr.data);
+
+    next_dump();
+}
+
+uint32_t rtnl::add_proxy_neigh(const std::string& ifname, const address& addr, callback cb, void* data)
+{
+    return proxy_neigh(RTM_NEWNEIGH, NLM_F_CREATE | NLM_F_REPLACE, ifname, addr, cb, data);
+}
+
+bool rtnl::del_proxy_neigh(const std::string& ifname, const address& addr)
+{
+    return proxy_neigh(RTM_DELNEIGH, 0, ifname, addr, NULL, NULL) != 0;
+}
+
+uint32_t rtnl::proxy_neigh(int type, int flags, const std::string& ifname, const address& addr,
+                           callback cb, void* data)
+{
+    logger::debug()
+        << "rtnl::proxy_neigh() type=" << type << ", ifname=" << ifname << ", addr=" << addr;
+
+    int ifindex;
+
+    if (!(ifindex = if_nametoindex(ifname.c_str()))) {
+        logger::error() << "Failed to get index of interface " << ifname << ": " << logger::err();
+        return 0;
+    }
+
+    union rtnl_request req;
+
+    memset(&req, 0, sizeof(req));
+
+    req.nlh.nlmsg_len   = NLMSG_LENGTH(sizeof(struct ndmsg));
+    req.nlh.nlmsg_type  = type;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+
+    struct ndmsg* nd = (struct ndmsg* )NLMSG_DATA(&req.nlh);
+
+    nd->ndm_family  = AF_INET6;
+    nd->ndm_ifindex = ifindex;
+    nd->ndm_state   = NUD_PERMANENT;
+    nd->ndm_flags   = NTF_PROXY;
+
+    add_attr(req, NDA_DST, &addr.const_addr(), sizeof(struct in6_addr));
+
+    uint32_t seq = send(&req.nlh);
+
+    if (seq && cb) {
+        request& r = _requests[seq];
+        r.cb   = cb;
+        r.data = data;
+    }
+
+    return seq;
+}
+
+uint32_t rtnl::add_route(const address& dst, const address& via, const std::string& ifname,
+                         callback cb, void* data)
+{
+    return route(RTM_NEWROUTE, NLM_F_CREATE | NLM_F_REPLACE, dst, via, ifname, cb, data);
+}
+
+uint32_t rtnl::del_route(const address& dst, const address& via, const std::string& ifname,
+                         callback cb, void* data)
+{
+    return route(RTM_DELROUTE, 0, dst, via, ifname, cb, data);
+}
+
+uint32_t rtnl::route(int type, int flags, const address& dst, const address& via,
+                     const std::string& ifname, callback cb, void* data)
+{
+    logger::debug()
+        << "rtnl::route() type=" << type << ", dst=" << dst << ", via=" << via << ", ifname=" << ifname;
+
+    int ifindex;
+
+    if (!(ifindex = if_nametoindex(ifname.c_str()))) {
+        logger::error() << "Failed to get index of interface " << ifname << ": " << logger::err();
+        return 0;
+    }
+
+    union rtnl_request req;
+
+    memset(&req, 0, sizeof(req));
+
+    req.nlh.nlmsg_len   = NLMSG_LENGTH(sizeof(struct rtmsg));
+    req.nlh.nlmsg_type  = type;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+
+    struct rtmsg* rt = (struct rtmsg* )NLMSG_DATA(&req.nlh);
+
+    rt->rtm_family  = AF_INET6;
+    rt->rtm_dst_len = dst.prefix();
+    rt->rtm_table   = RT_TABLE_MAIN;
+
+    // Same as what "ip -6 route replace/del" would use.
+
+    if (type == RTM_DELROUTE) {
+        rt->rtm_scope    = RT_SCOPE_NOWHERE;
+    } else {
+        rt->rtm_protocol = RTPROT_BOOT;
+        rt->rtm_scope    = RT_SCOPE_UNIVERSE;
+        rt->rtm_type     = RTN_UNICAST;
+    }
+
+    add_attr(req, RTA_DST, &dst.const_addr(), sizeof(struct in6_addr));
+    add_attr(req, RTA_OIF, &ifindex, sizeof(ifindex));
+
+    if (!via.is_empty())
+        add_attr(req, RTA_GATEWAY, &via.const_addr(), sizeof(struct in6_addr));
+
+    uint32_t seq = send(&req.nlh);
+
+    if (seq && cb) {
+        request& r = _requests[seq];
+        r.cb   = cb;
+        r.data = data;
+    }
+
+    return seq;
+}
+
+uint32_t rtnl::send(struct nlmsghdr* nlh)
+{
+    if ((_fd < 0) && !open())
+        return 0;
+
+    // Zero means "no request".
+    if (!++_seq)
+        ++_seq;
+
+    nlh->nlmsg_seq = _seq;
+
+    struct sockaddr_nl snl;
+
+    memset(&snl, 0, sizeof(snl));
+    snl.nl_family = AF_NETLINK;
+
+    if (sendto(_fd, nlh, nlh->nlmsg_len, 0, (struct sockaddr* )&snl, sizeof(snl)) < 0) {
+        logger::error() << "Failed to send netlink request: " << logger::err();
+        return 0;
+    }
+
+    return _seq;
+}
+
+void rtnl::handle_event(int fd, uint32_t events, void* data)
+{
+    static uint8_t buf[16384];
+
+    for (;;) {
+        ssize_t len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+
+        if (len < 0) {
+            if (errno == ENOBUFS) {
+                // Some notifications were dropped; let everyone who's
+                // listening start over.
+
+                logger::warning() << "Lost netlink notifications, resynchronizing";
+
+                // The acknowledgements of some requests may have been
+                // among them, and they'd wait forever.
+                fail_requests(ENOBUFS);
+
+                for (std::vector<void (*)()>::iterator it = _resyncs.begin(); it != _resyncs.end(); it++)
+                    (*it)();
+
+                continue;
+            }
+
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+                logger::error() << "Failed to read from netlink socket: " << logger::err();
+            return;
+        }
+
+        for (struct nlmsghdr* nlh = (struct nlmsghdr* )buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type == NLMSG_ERROR) {
+                handle_error(nlh);
+                continue;
+            }
+
+            if (nlh->nlmsg_type == NLMSG_DONE) {
+                if (_dump_seq && (nlh->nlmsg_seq == _dump_seq))
+                    end_dump(0);
+                continue;
+            }
+
+            std::map<int, handler>::iterator it = _handlers.find(nlh->nlmsg_type);
+
+            if (it != _handlers.end())
+                it->second(nlh);
+        }
+    }
+}
+
+void rtnl::fail_requests(int error)
+{
+    // The callbacks may send new requests, so take each one out of
+    // _requests before invoking it.
+
+    while (!_requests.empty()) {
+        std::map<uint32_t, request>::iterator it = _requests.begin();
+
+        uint32_t seq = it->first;
+        request r    = it->second;
+
+        _requests.erase(it);
+
+        r.cb(seq, error, r.data);
+    }
+}
+
+void rtnl::handle_error(const struct nlmsghdr* nlh)
+{
+    const struct nlmsgerr* err = (const struct nlmsgerr* )NLMSG_DATA(nlh);
+
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct nlmsgerr)))
+        return;
+
+    if (_dump_seq && (nlh->nlmsg_seq == _dump_seq)) {
+        end_dump(-err->error);
+        return;
+    }
+
+    std::map<uint32_t, request>::iterator it = _requests.find(nlh->nlmsg_seq);
+
+    if (it != _requests.end()) {
+        request r = it->second;
+        _requests.erase(it);
+        r.cb(nlh->nlmsg_seq, -err->error, r.data);
+        return;
+    }
+
+    if (!err->error)
+        return;
+
+    // Removing something that's already gone is fine.
+
+    if ((err->error == -ENOENT) && (err->msg.nlmsg_type == RTM_DELNEIGH))
+        return;
+
+    logger::error()
+        << "Netlink request failed: type=" << err->msg.nlmsg_type
+        << ", seq=" << err->msg.nlmsg_seq << ", error=" << strerror(-err->error);
+}
+
+NDPPD_NS_END
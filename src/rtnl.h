@@ -0,0 +1,144 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+
+#include <stdint.h>
+#include <linux/netlink.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// A minimal rtnetlink client. Requests are sent on a non-blocking socket
+// that is watched by the event loop, which also picks up the kernel's
+// acknowledgements and logs the requests that failed. The same socket
+// receives dumps and the notifications of the groups it has joined.
+
+class rtnl {
+public:
+    // Called when the kernel has acknowledged request 'seq'. 'error' is
+    // zero on success, or an errno value.
+    typedef void (*callback)(uint32_t seq, int error, void* data);
+
+    // Called for every message of a type passed to watch(), whether it
+    // is part of a dump or a notification.
+    typedef void (*handler)(const struct nlmsghdr* nlh);
+
+    static bool open();
+
+    // Adds a proxy neighbor entry for 'addr' on the interface 'ifname',
+    // like "ip -6 neigh add proxy <addr> dev <ifname>" does. The kernel
+    // then answers solicits for 'addr' by itself, as long as proxy_ndp
+    // is enabled on the interface.
+    // Returns the sequence number of the request, or 0 if it couldn't be
+    // sent. 'cb' is invoked with 'data' as with add_route().
+    static uint32_t add_proxy_neigh(const std::string& ifname, const address& addr,
+                                    callback cb = NULL, void* data = NULL);
+
+    // Removes a proxy neighbor entry added by add_proxy_neigh().
+    static bool del_proxy_neigh(const std::string& ifname, const address& addr);
+
+    // Adds or replaces a route to 'dst' through the interface 'ifname', via
+    // the gateway 'via' unless it's empty. Returns the sequence number of
+    // the request, or 0 if it couldn't be sent. 'cb' is invoked with
+    // 'data' once the kernel has acknowledged the request, or with
+    // ENOBUFS if the acknowledgement may have been lost; either way, it's
+    // invoked exactly once if the request was sent.
+    static uint32_t add_route(const address& dst, const address& via, const std::string& ifname,
+                              callback cb = NULL, void* data = NULL);
+
+    // Deletes a route added with add_route().
+    static uint32_t del_route(const address& dst, const address& via, const std::string& ifname,
+                              callback cb = NULL, void* data = NULL);
+
+    // Passes the messages of type 'type' (RTM_NEWROUTE, ...) to 'h'.
+    static void watch(int type, handler h);
+
+    // Joins the multicast group 'group' (RTNLGRP_IPV6_ROUTE, ...).
+    // Notifications are lost if the socket's receive buffer overflows;
+    // 'resync' is invoked when that happens, so the caller can dump
+    // everything again.
+    static bool subscribe(int group, void (*resync)());
+
+    // Asks for all objects of a kind (RTM_GETROUTE, ...) in 'family'. They
+    // are passed to the handlers registered with watch(), and 'cb' is
+    // invoked once the dump is complete. Only one dump runs at a time, so
+    // dumps may be queued until the previous one is done. An earlier dump
+    // of the same kind with the same 'cb' is superseded: 'cb' is invoked
+    // for it with ECANCELED, right away if it hasn't been sent yet, or
+    // when it completes otherwise.
+    static bool dump(int type, int family, callback cb = NULL, void* data = NULL);
+
+private:
+    struct request {
+        callback cb;
+        void* data;
+    };
+
+    struct dump_request {
+        int type, family;
+        callback cb;
+        void* data;
+        bool superseded;
+    };
+
+    static int _fd;
+
+    static uint32_t _seq;
+
+    // Requests that want to know how they went, by sequence number.
+    static std::map<uint32_t, request> _requests;
+
+    // Invokes the callbacks of all requests in _requests with 'error',
+    // since their acknowledgements won't arrive.
+    static void fail_requests(int error);
+
+    static std::map<int, handler> _handlers;
+
+    static std::vector<void (*)()> _resyncs;
+
+    // Dumps waiting to be sent; the first one is in progress if _dump_seq
+    // isn't 0.
+    static std::list<dump_request> _dumps;
+
+    static uint32_t _dump_seq;
+
+    // Sends the next queued dump request, if none is in progress.
+    static void next_dump();
+
+    // Called when the dump in progress is done.
+    static void end_dump(int error);
+
+    static uint32_t proxy_neigh(int type, int flags, const std::string& ifname, const address& addr,
+                                callback cb, void* data);
+
+    static uint32_t route(int type, int flags, const address& dst, const address& via,
+                          const std::string& ifname, callback cb, void* data);
+
+    // Sends a request, and returns its sequence number or 0.
+    static uint32_t send(struct nlmsghdr* nlh);
+
+    static void handle_event(int fd, uint32_t events, void* data);
+
+    static void handle_error(const struct nlmsghdr* nlh);
+};
+
+NDPPD_NS_END
@@ -33,10 +33,16 @@ bool rule::_any_iface = false;
 
 bool rule::_any_static = false;
 
-rule::rule()
+rule::rule() :
+    _stats(new counters())
 {
 }
 
+rule::~rule()
+{
+    delete _stats;
+}
+
 ptr<rule> rule::create(const ptr<proxy>& pr, const address& addr, const ptr<iface>& ifa)
 {
     ptr<rule> ru(new rule());
@@ -121,6 +127,11 @@ bool rule::any_static()
     return _any_static;
 }
 
+counters& rule::stats()
+{
+    return *_stats;
+}
+
 bool rule::check(const address& addr) const
 {
     return _addr == addr;
@@ -29,12 +29,14 @@ NDPPD_NS_BEGIN
 class iface;
 class proxy;
 
-class rule {
+class rule : public refcounted {
 public:
     static ptr<rule> create(const ptr<proxy>& pr, const address& addr, const ptr<iface>& ifa);
 
     static ptr<rule> create(const ptr<proxy>& pr, const address& addr, bool stc = true);
 
+    ~rule();
+
     const address& addr() const;
 
     ptr<iface> daughter() const;
@@ -53,6 +55,9 @@ public:
 
     void autovia(bool val);
 
+    // Returns the counters of the sessions created for this rule.
+    counters& stats();
+
 private:
     weak_ptr<rule> _ptr;
 
@@ -72,6 +77,8 @@ private:
     
     bool _autovia;
 
+    counters* _stats;
+
     rule();
 };
 
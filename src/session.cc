@@ -14,7 +14,9 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <algorithm>
-#include <sstream>
+#include <cstring>
+
+#include <errno.h>
 
 #include "ndppd.h"
 #include "proxy.h"
@@ -23,24 +25,28 @@
 
 NDPPD_NS_BEGIN
 
-std::list<weak_ptr<session> > session::_sessions;
-
 static address all_nodes = address("ff02::1");
 
-void session::update_all(int elapsed_time)
+void session::update_all()
 {
-    for (std::list<weak_ptr<session> >::iterator it = _sessions.begin();
-            it != _sessions.end(); ) {
-        if (!*it) {
-            _sessions.erase(it++);
-            continue;
-        }
+    std::vector<timer*> expired;
 
-        ptr<session> se = *it++;
+    timer::expire(loop::now(), expired);
+
+    // Grab references to all of them first, since dealing with one
+    // session may release another.
+
+    std::vector<ptr<session> > sessions;
+
+    for (std::vector<timer*>::iterator it = expired.begin(); it != expired.end(); it++) {
+        sessions.push_back(((session*)(*it)->data())->_ptr);
+    }
 
-        if ((se->_ttl -= elapsed_time) >= 0) {
+    for (std::vector<ptr<session> >::iterator it = sessions.begin(); it != sessions.end(); it++) {
+        ptr<session> se = *it;
+
+        if (!se)
             continue;
-        }
 
         switch (se->_status) {
             
@@ -48,17 +54,19 @@ void session::update_all(int elapsed_time)
             if (se->_fails < se->_retries) {
                 logger::debug() << "session will keep trying [taddr=" << se->_taddr << "]";
                 
-                se->_ttl     = se->_pr->timeout();
+                se->_timer.schedule_in(se->_pr->timeout());
                 se->_fails++;
                 
                 // Send another solicit
+                se->count(&counters::retries);
                 se->send_solicit();
             } else {
                 
                 logger::debug() << "session is now invalid [taddr=" << se->_taddr << "]";
                 
-                se->_status = session::INVALID;
-                se->_ttl    = se->_pr->deadtime();
+                se->count(&counters::sessions_invalid);
+                se->status(session::INVALID);
+                se->_timer.schedule_in(se->_pr->deadtime());
             }
             break;
             
@@ -66,12 +74,14 @@ void session::update_all(int elapsed_time)
             logger::debug() << "session is became invalid [taddr=" << se->_taddr << "]";
             
             if (se->_fails < se->_retries) {
-                se->_ttl     = se->_pr->timeout();
+                se->_timer.schedule_in(se->_pr->timeout());
                 se->_fails++;
                 
                 // Send another solicit
+                se->count(&counters::retries);
                 se->send_solicit();
             } else {            
+                se->count(&counters::sessions_invalid);
                 se->_pr->remove_session(se);
             }
             break;
@@ -81,14 +91,15 @@ void session::update_all(int elapsed_time)
                 se->keepalive() == true)
             {
                 logger::debug() << "session is renewing [taddr=" << se->_taddr << "]";
-                se->_status  = session::RENEWING;
-                se->_ttl     = se->_pr->timeout();
+                se->status(session::RENEWING);
+                se->_timer.schedule_in(se->_pr->timeout());
                 se->_fails   = 0;
                 se->_touched = false;
 
                 // Send another solicit to make sure the route is still valid
                 se->send_solicit();
             } else {
+                se->count(&counters::sessions_expired);
                 se->_pr->remove_session(se);
             }            
             break;
@@ -97,6 +108,19 @@ void session::update_all(int elapsed_time)
             se->_pr->remove_session(se);
         }
     }
+
+    // Make sure we're woken up in time to deal with the next one.
+
+    uint64_t next = timer::next();
+
+    if (next)
+        loop::wakeup_in((int)(next - loop::now()));
+}
+
+session::session() :
+    _autowire(false), _keepalive(false), _wired(false), _touched(false), _offloaded(false),
+    _timer(this), _fails(0), _retries(0), _status(WAITING)
+{
 }
 
 session::~session()
@@ -109,23 +133,33 @@ session::~session()
             handle_auto_unwire((*it)->name());
         }
     }
+
+    if (_offload_ifa) {
+        rtnl::del_proxy_neigh(_offload_ifa->name(), _taddr);
+    }
+
+    if (!_pr.is_null())
+        _pr->count_session(_status, -1);
 }
 
-ptr<session> session::create(const ptr<proxy>& pr, const address& taddr, bool auto_wire, bool keepalive, int retries)
+ptr<session> session::create(const ptr<proxy>& pr, const ptr<rule>& ru, const address& taddr,
+                             bool auto_wire, bool keepalive, int retries)
 {
     ptr<session> se(new session());
 
     se->_ptr       = se;
     se->_pr        = pr;
+    se->_ru        = ru;
     se->_taddr     = taddr;
     se->_autowire  = auto_wire;
     se->_keepalive = keepalive;
     se->_retries   = retries;
     se->_wired     = false;
-    se->_ttl       = pr->ttl();
     se->_touched   = false;
 
-    _sessions.push_back(se);
+    se->_timer.schedule_in(pr->ttl());
+
+    pr->count_session(-1, se->_status);
 
     logger::debug()
         << "session::create() pr=" << logger::format("%x", (proxy* )pr) << ", proxy=" << ((pr->ifa()) ? pr->ifa()->name() : "null")
@@ -140,27 +174,57 @@ void session::add_iface(const ptr<iface>& ifa)
         return;
 
     _ifaces.push_back(ifa);
+    _solicits.push_back(nd_template());
 }
 
-void session::add_pending(const address& addr)
+void session::add_pending(const address& addr, const struct ether_addr& lladdr, uint64_t stamp)
 {
-    for (std::list<ptr<address> >::iterator ad = _pending.begin(); ad != _pending.end(); ad++) {
-        if (addr == (*ad))
+    for (std::list<pending>::iterator ad = _pending.begin(); ad != _pending.end(); ad++) {
+        if (addr == ad->addr) {
+            ad->lladdr = lladdr;
             return;
+        }
     }
 
-    _pending.push_back(new address(addr));
+    pending p;
+    p.addr   = addr;
+    p.lladdr = lladdr;
+    p.stamp  = stamp;
+
+    _pending.push_back(p);
 }
 
 void session::send_solicit()
 {
     logger::debug() << "session::send_solicit() (_ifaces.size() = " << _ifaces.size() << ")";
 
+    std::list<nd_template>::iterator tpl = _solicits.begin();
+
     for (std::list<ptr<iface> >::iterator it = _ifaces.begin();
-            it != _ifaces.end(); it++) {
+            it != _ifaces.end(); it++, tpl++) {
         logger::debug() << " - " << (*it)->name();
-        (*it)->write_solicit(_taddr);
+        (*it)->write_solicit(_taddr, *tpl);
     }
+
+    count(&counters::ns_tx, _ifaces.size());
+}
+
+void session::probe()
+{
+    if (_ifaces.empty())
+        return;
+
+    logger::debug() << "session is probing again [taddr=" << _taddr << "]";
+
+    if (_status == VALID)
+        status(RENEWING);
+    else if (_status == INVALID)
+        status(WAITING);
+
+    _fails = 0;
+    _timer.schedule_in(_pr->timeout());
+
+    send_solicit();
 }
 
 void session::touch()
@@ -170,7 +234,7 @@ void session::touch()
         _touched = true;
         
         if (status() == session::WAITING || status() == session::INVALID) {
-            _ttl = _pr->timeout();
+            _timer.schedule_in(_pr->timeout());
             
             logger::debug() << "session is now probing [taddr=" << _taddr << "]";
             
@@ -179,9 +243,23 @@ void session::touch()
     }
 }
 
-void session::send_advert(const address& daddr)
+void session::send_advert(const address& daddr, const struct ether_addr& lladdr, uint64_t stamp, bool discovered)
 {
-    _pr->ifa()->write_advert(daddr, _taddr, _pr->router());
+    count(&counters::na_tx);
+
+    if (stamp) {
+        uint64_t now = loop::stamp();
+
+        // The clock may have been stepped since.
+        if (now >= stamp)
+            (discovered ? _pr->discovery_latency() : _pr->hit_latency()).record(now - stamp);
+    }
+
+    if (_pr->raw_advert()) {
+        _pr->ifa()->write_raw_advert(daddr, lladdr, _taddr, _pr->router(), _advert);
+    } else {
+        _pr->ifa()->write_advert(daddr, _taddr, _pr->router(), _advert);
+    }
 }
 
 void session::handle_auto_wire(const address& saddr, const std::string& ifname, bool use_via)
@@ -197,46 +275,17 @@ void session::handle_auto_wire(const address& saddr, const std::string& ifname,
         saddr.is_unicast() == true &&
         saddr.is_multicast() == false)
     {
-        std::stringstream route_cmd;
-        route_cmd << "ip";
-        route_cmd << " " << "-6";
-        route_cmd << " " << "route";
-        route_cmd << " " << "replace";
-        route_cmd << " " << std::string(saddr);
-        route_cmd << " " << "dev";
-        route_cmd << " " << ifname;
-
-        logger::debug()
-            << "session::system(" << route_cmd.str() << ")";
-        
-        system(route_cmd.str().c_str());
+        wire_route(true, saddr, address(), ifname);
         
         _wired_via = saddr;
     }
     else
         _wired_via.reset();
     
-    {
-        std::stringstream route_cmd;
-        route_cmd << "ip";
-        route_cmd << " " << "-6";
-        route_cmd << " " << "route";
-        route_cmd << " " << "replace";
-        route_cmd << " " << std::string(_taddr);
-        if (_wired_via.is_empty() == false) {
-            route_cmd << " " << "via";
-            route_cmd << " " << std::string(_wired_via);
-        }
-        route_cmd << " " << "dev";
-        route_cmd << " " << ifname;
-
-        logger::debug()
-            << "session::system(" << route_cmd.str() << ")";
-
-        system(route_cmd.str().c_str());
-    }
+    wire_route(true, _taddr, _wired_via, ifname);
     
     _wired = true;
+    _wired_ifname = ifname;
 }
 
 void session::handle_auto_unwire(const std::string& ifname)
@@ -244,48 +293,82 @@ void session::handle_auto_unwire(const std::string& ifname)
     logger::debug()
         << "session::handle_auto_unwire() taddr=" << _taddr << ", ifname=" << ifname;
     
-    {
-        std::stringstream route_cmd;
-        route_cmd << "ip";
-        route_cmd << " " << "-6";
-        route_cmd << " " << "route";
-        route_cmd << " " << "flush";
-        route_cmd << " " << std::string(_taddr);
-        if (_wired_via.is_empty() == false) {
-            route_cmd << " " << "via";
-            route_cmd << " " << std::string(_wired_via);
-        }
-        route_cmd << " " << "dev";
-        route_cmd << " " << ifname;
-
-        logger::debug()
-            << "session::system(" << route_cmd.str() << ")";
-
-        system(route_cmd.str().c_str());
-    }
+    wire_route(false, _taddr, _wired_via, ifname);
     
     if (_wired_via.is_empty() == false) {
-        std::stringstream route_cmd;
-        route_cmd << "ip";
-        route_cmd << " " << "-6";
-        route_cmd << " " << "route";
-        route_cmd << " " << "flush";
-        route_cmd << " " << std::string(_wired_via);
-        route_cmd << " " << "dev";
-        route_cmd << " " << ifname;
-
-        logger::debug()
-            << "session::system(" << route_cmd.str() << ")";
-
-        system(route_cmd.str().c_str());
+        wire_route(false, _wired_via, address(), ifname);
     }
     
     _wired = false;
     _wired_via.reset();
+    _wired_ifname.clear();
+}
+
+void session::wire_route(bool add, const address& dst, const address& via, const std::string& ifname)
+{
+    route_request* rr = new route_request();
+
+    // Routes are removed when the session is destroyed, by which time
+    // _ptr can no longer be copied; those requests don't need it anyway.
+    if (add)
+        rr->se = _ptr;
+
+    rr->taddr = _taddr;
+    rr->dst   = dst;
+    rr->add   = add;
+
+    uint32_t seq = add ?
+        rtnl::add_route(dst, via, ifname, session::handle_route_ack, rr) :
+        rtnl::del_route(dst, via, ifname, session::handle_route_ack, rr);
+
+    if (!seq) {
+        logger::error()
+            << "Failed to " << (add ? "add" : "delete") << " route to " << dst
+            << " [taddr=" << _taddr << "]";
+        delete rr;
+        return;
+    }
+
+    count(add ? &counters::routes_added : &counters::routes_removed);
+}
+
+void session::handle_route_ack(uint32_t seq, int error, void* data)
+{
+    route_request* rr = (route_request* )data;
+
+    // The session may be gone, in which case its pointer can't be copied.
+
+    ptr<session> se;
+
+    if (!rr->se.is_null())
+        se = rr->se;
+
+    bool add = rr->add;
+    address taddr = rr->taddr, dst = rr->dst;
+
+    delete rr;
+
+    // Deleting a route that's already gone is fine.
+
+    if (!error || (!add && ((error == ESRCH) || (error == ENOENT))))
+        return;
+
+    logger::error()
+        << "Failed to " << (add ? "add" : "delete") << " route to " << dst
+        << " [taddr=" << taddr << "]: " << strerror(error);
+
+    // Try again with the next advert.
+
+    if (se && add) {
+        se->count(&counters::route_errors);
+        se->_wired = false;
+    }
 }
 
 void session::handle_advert(const address& saddr, const std::string& ifname, bool use_via)
 {
+    count(&counters::na_rx);
+
     if (_autowire == true && _status == WAITING) {
         handle_auto_wire(saddr, ifname, use_via);
     }
@@ -300,21 +383,20 @@ void session::handle_advert()
         << "session::handle_advert() taddr=" << _taddr << ", ttl=" << _pr->ttl();
     
     if (_status != VALID) {
-        _status = VALID;
+        status(VALID);
         
         logger::debug() << "session is active [taddr=" << _taddr << "]";
     }
     
-    _ttl    = _pr->ttl();
+    _timer.schedule_in(_pr->ttl());
     _fails  = 0;
     
     if (!_pending.empty()) {
-        for (std::list<ptr<address> >::iterator ad = _pending.begin();
+        for (std::list<pending>::iterator ad = _pending.begin();
                 ad != _pending.end(); ad++) {
-            ptr<address> addr = (*ad);
-            logger::debug() << " - forward to " << addr;
+            logger::debug() << " - forward to " << ad->addr;
 
-            send_advert(addr);
+            send_advert(ad->addr, ad->lladdr, ad->stamp, true);
         }
 
         _pending.clear();
@@ -326,11 +408,77 @@ const address& session::taddr() const
     return _taddr;
 }
 
+ptr<rule> session::ru() const
+{
+    return _ru.is_null() ? ptr<rule>() : ptr<rule>(_ru);
+}
+
+void session::count(uint64_t counters::* c, uint64_t n)
+{
+    // Sessions outlive their proxy (and its rules) while it's being
+    // destroyed, and can't take references to it by then.
+
+    if (!_pr.is_null())
+        _pr->stats().*c += n;
+
+    if (!_ru.is_null())
+        _ru->stats().*c += n;
+}
+
 bool session::autowire() const
 {
     return _autowire;
 }
 
+bool session::offloaded() const
+{
+    return _offloaded;
+}
+
+void session::offload()
+{
+    if (_offload_ifa || !_pr->ifa())
+        return;
+
+    weak_ptr<session>* se = new weak_ptr<session>(_ptr);
+
+    if (!rtnl::add_proxy_neigh(_pr->ifa()->name(), _taddr, session::handle_offload_ack, se)) {
+        delete se;
+        return;
+    }
+
+    // Even if the kernel turns it down, removing the entry does no harm.
+    _offload_ifa = _pr->ifa();
+}
+
+void session::handle_offload_ack(uint32_t seq, int error, void* data)
+{
+    weak_ptr<session>* wse = (weak_ptr<session>* )data;
+
+    // The session may be gone, in which case its pointer can't be copied.
+
+    ptr<session> se;
+
+    if (!wse->is_null())
+        se = *wse;
+
+    delete wse;
+
+    if (!se)
+        return;
+
+    if (error) {
+        logger::warning()
+            << "Failed to offload session [taddr=" << se->_taddr << "]: " << strerror(error)
+            << "; answering solicits for it ourselves";
+        return;
+    }
+
+    logger::debug() << "session is now offloaded [taddr=" << se->_taddr << "]";
+
+    se->_offloaded = true;
+}
+
 bool session::keepalive() const
 {
     return _keepalive;
@@ -351,6 +499,11 @@ bool session::wired() const
     return _wired;
 }
 
+const std::string& session::wired_ifname() const
+{
+    return _wired_ifname;
+}
+
 bool session::touched() const
 {
     return _touched;
@@ -363,7 +516,23 @@ int session::status() const
 
 void session::status(int val)
 {
+    if (val == _status)
+        return;
+
+    if (!_pr.is_null())
+        _pr->count_session(_status, val);
+
     _status = val;
 }
 
+int session::ttl() const
+{
+    if (!_timer.pending())
+        return 0;
+
+    int64_t ms = (int64_t)(_timer.deadline() - loop::now());
+
+    return (ms > 0) ? (int)ms : 0;
+}
+
 NDPPD_NS_END
@@ -18,19 +18,25 @@
 #include <vector>
 #include <string>
 
+#include <stdint.h>
+
 #include "ndppd.h"
 
 NDPPD_NS_BEGIN
 
 class proxy;
 class iface;
+class rule;
 
-class session {
+class session : public refcounted {
 private:
     weak_ptr<session> _ptr;
 
     weak_ptr<proxy> _pr;
 
+    // The rule the session was created for.
+    weak_ptr<rule> _ru;
+
     address _saddr, _daddr, _taddr;
     
     bool _autowire;
@@ -40,18 +46,41 @@ private:
     bool _wired;
     
     address _wired_via;
+
+    // The interface the route to the target was added on, if any.
+    std::string _wired_ifname;
     
     bool _touched;
 
+    // The interface on which we've asked the kernel for a proxy neighbor
+    // entry for the target, if any, and whether it has confirmed it.
+    ptr<iface> _offload_ifa;
+
+    bool _offloaded;
+
     // An array of interfaces this session is monitoring for
     // ND_NEIGHBOR_ADVERT on.
     std::list<ptr<iface> > _ifaces;
+
+    // Prebuilt solicits for the target, in the same order as _ifaces.
+    std::list<nd_template> _solicits;
+
+    // Prebuilt advert for the target, sent on the proxy's interface.
+    nd_template _advert;
     
-    std::list<ptr<address> > _pending;
+    // Solicitors waiting for an advert, their link-layer addresses, and
+    // when they first asked.
+    struct pending {
+        address addr;
+        struct ether_addr lladdr;
+        uint64_t stamp;
+    };
+
+    std::list<pending> _pending;
 
-    // The remaining time in miliseconds the object will stay in the
-    // interface's session array or cache.
-    int _ttl;
+    // Expires when the session's current state has run its course; see
+    // update_all().
+    timer _timer;
     
     int _fails;
     
@@ -59,7 +88,26 @@ private:
 
     int _status;
 
-    static std::list<weak_ptr<session> > _sessions;
+    // A route request from handle_auto_wire() or handle_auto_unwire(),
+    // passed to handle_route_ack() once the kernel has acknowledged it.
+    struct route_request {
+        weak_ptr<session> se;
+        address taddr, dst;
+        bool add;
+    };
+
+    static void handle_route_ack(uint32_t seq, int error, void* data);
+
+    // Called with a weak_ptr<session> once the kernel has acknowledged
+    // the proxy neighbor entry asked for by offload().
+    static void handle_offload_ack(uint32_t seq, int error, void* data);
+
+    void wire_route(bool add, const address& dst, const address& via, const std::string& ifname);
+
+    // Adds 'n' to one of the counters of both the proxy and the rule.
+    void count(uint64_t counters::* c, uint64_t n = 1);
+
+    session();
 
 public:
     enum
@@ -70,19 +118,23 @@ public:
         INVALID   // Invalid;
     };
 
-    static void update_all(int elapsed_time);
+    // Deals with the sessions whose timers have expired.
+    static void update_all();
 
     // Destructor.
     ~session();
 
-    static ptr<session> create(const ptr<proxy>& pr, const address& taddr, bool autowire, bool keepalive, int retries);
+    static ptr<session> create(const ptr<proxy>& pr, const ptr<rule>& ru, const address& taddr,
+                               bool autowire, bool keepalive, int retries);
 
     void add_iface(const ptr<iface>& ifa);
     
-    void add_pending(const address& addr);
+    void add_pending(const address& addr, const struct ether_addr& lladdr, uint64_t stamp);
 
     const address& taddr() const;
 
+    ptr<rule> ru() const;
+
     const address& daddr() const;
 
     const address& saddr() const;
@@ -96,11 +148,26 @@ public:
     bool keepalive() const;
     
     bool wired() const;
+
+    const std::string& wired_ifname() const;
     
     bool touched() const;
 
+    bool offloaded() const;
+
+    // Installs a proxy neighbor entry for the target on the proxy's
+    // interface, so that the kernel answers solicits for it. The session
+    // counts as offloaded once the kernel has accepted the entry, and
+    // until then we keep answering. The entry is removed when the session
+    // goes away.
+    void offload();
+
     int status() const;
 
+    // The remaining time in milliseconds until the session's current
+    // state expires.
+    int ttl() const;
+
     void status(int val);
     
     void handle_advert();
@@ -113,10 +180,18 @@ public:
     
     void touch();
 
-    void send_advert(const address& daddr);
+    // Answers a solicit received at 'stamp' (see loop::stamp()), and
+    // records how long that took in the proxy's discovery or hit latency
+    // histogram. A 'stamp' of 0 isn't recorded.
+    void send_advert(const address& daddr, const struct ether_addr& lladdr, uint64_t stamp, bool discovered);
 
     void send_solicit();
 
+    // Solicits the target again right away, as if the session had just
+    // been touched, to find out whether it's still there. Sessions that
+    // don't solicit anyone are left alone.
+    void probe();
+
     void refesh();
 };
 
@@ -0,0 +1,229 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include "ndppd.h"
+#include "timer.h"
+
+NDPPD_NS_BEGIN
+
+timer timer::_slots[LEVELS][SLOTS];
+
+uint64_t timer::_bitmap[LEVELS];
+
+uint64_t timer::_tick;
+
+timer::timer(void* data) :
+    _deadline(0), _data(data)
+{
+    // An unlinked timer (and an empty slot) points at itself.
+    _next = _prev = this;
+}
+
+timer::~timer()
+{
+    cancel();
+}
+
+void timer::schedule(uint64_t deadline)
+{
+    if (!_tick)
+        _tick = loop::now();
+
+    unlink(this);
+    _deadline = deadline;
+    add(this);
+}
+
+void timer::schedule_in(int ms)
+{
+    schedule(loop::now() + ((ms > 0) ? ms : 0));
+}
+
+void timer::cancel()
+{
+    unlink(this);
+}
+
+bool timer::pending() const
+{
+    return _next != this;
+}
+
+uint64_t timer::deadline() const
+{
+    return _deadline;
+}
+
+void* timer::data() const
+{
+    return _data;
+}
+
+void timer::add(timer* t)
+{
+    uint64_t expires = t->_deadline;
+
+    if (expires < _tick) {
+        expires = _tick;
+    } else if ((expires - _tick) >> (LEVELS * SLOT_BITS)) {
+        // Too far away; park it in the last slot, and it'll be placed
+        // properly once it has cascaded down.
+        expires = _tick + (1 << (LEVELS * SLOT_BITS)) - 1;
+    }
+
+    uint64_t delta = expires - _tick;
+
+    int level = 0;
+
+    while ((level < LEVELS - 1) && (delta >> ((level + 1) * SLOT_BITS)))
+        level++;
+
+    int slot = (expires >> (level * SLOT_BITS)) & SLOT_MASK;
+
+    timer* head = &_slots[level][slot];
+
+    t->_prev          = head->_prev;
+    t->_next          = head;
+    head->_prev->_next = t;
+    head->_prev       = t;
+
+    _bitmap[level] |= 1ULL << slot;
+}
+
+void timer::unlink(timer* t)
+{
+    if (t->_next == t)
+        return;
+
+    timer* next = t->_next;
+
+    t->_prev->_next = next;
+    next->_prev     = t->_prev;
+
+    t->_next = t->_prev = t;
+
+    // If the timer was the last one in its slot, 'next' is now the head
+    // of an empty slot, so clear the slot's bit.
+
+    if ((next->_next == next) && (next >= &_slots[0][0]) && (next < &_slots[0][0] + LEVELS * SLOTS)) {
+        int i = next - &_slots[0][0];
+        _bitmap[i / SLOTS] &= ~(1ULL << (i % SLOTS));
+    }
+}
+
+void timer::cascade(int level)
+{
+    int slot = (_tick >> (level * SLOT_BITS)) & SLOT_MASK;
+
+    timer* head = &_slots[level][slot];
+
+    if (head->_next == head)
+        return;
+
+    // Detach the list first, so that timers which end up in the same
+    // slot again don't get processed twice.
+
+    timer* first = head->_next;
+    timer* last  = head->_prev;
+
+    head->_next = head->_prev = head;
+    _bitmap[level] &= ~(1ULL << slot);
+
+    last->_next = NULL;
+
+    for (timer* t = first; t; ) {
+        timer* next = t->_next;
+        t->_next = t->_prev = t;
+        add(t);
+        t = next;
+    }
+}
+
+uint64_t timer::next()
+{
+    if (!_tick)
+        return 0;
+
+    uint64_t best = 0;
+
+    for (int level = 0; level < LEVELS; level++) {
+        if (!_bitmap[level])
+            continue;
+
+        int shift = level * SLOT_BITS;
+
+        // The first tick, not before _tick, at which this level is
+        // looked at; level 0 every tick, the others each time the
+        // level below wraps around.
+
+        uint64_t unit  = 1ULL << shift;
+        uint64_t first = (_tick + unit - 1) & ~(unit - 1);
+        int cur        = (first >> shift) & SLOT_MASK;
+
+        // Rotate the bitmap so that bit 0 is the slot at 'first'.
+        uint64_t bits = (_bitmap[level] >> cur) | (cur ? (_bitmap[level] << (SLOTS - cur)) : 0);
+
+        uint64_t t = first + (uint64_t)__builtin_ctzll(bits) * unit;
+
+        if (!best || (t < best))
+            best = t;
+    }
+
+    return best;
+}
+
+void timer::expire(uint64_t now, std::vector<timer*>& expired)
+{
+    if (!_tick) {
+        _tick = now;
+        return;
+    }
+
+    while (_tick <= now) {
+        // Skip straight to the next tick where there's something to do.
+
+        uint64_t t = next();
+
+        if (!t || (t > now)) {
+            _tick = now + 1;
+            break;
+        }
+
+        _tick = t;
+
+        // Cascade the levels whose lower levels have just wrapped around,
+        // starting from the top.
+
+        for (int level = LEVELS - 1; level > 0; level--) {
+            if (!(_tick & ((1ULL << (level * SLOT_BITS)) - 1)))
+                cascade(level);
+        }
+
+        // Everything that's left in the current level 0 slot is due.
+
+        int slot    = _tick & SLOT_MASK;
+        timer* head = &_slots[0][slot];
+
+        while (head->_next != head) {
+            timer* e = head->_next;
+            unlink(e);
+            expired.push_back(e);
+        }
+
+        _tick++;
+    }
+}
+
+NDPPD_NS_END
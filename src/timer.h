@@ -0,0 +1,102 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <vector>
+
+#include <stdint.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// A timer that lives in a hierarchical timing wheel, keyed by an absolute
+// deadline in milliseconds (see loop::now()).
+//
+// The wheel has four levels of 64 slots each. Level 0 has one slot per
+// millisecond, and each following level is 64 times coarser, which
+// covers about 4.6 hours. Timers further out than that are parked in the
+// last slot of level 3. Timers move down a level each time the level
+// below wraps around, so scheduling, cancelling and expiring a timer are
+// all O(1), and expire() only touches timers that are actually due.
+
+class timer {
+public:
+    timer(void* data = NULL);
+
+    ~timer();
+
+    // Schedules the timer to expire at 'deadline', replacing any previous
+    // deadline.
+    void schedule(uint64_t deadline);
+
+    // Schedules the timer to expire in 'ms' milliseconds from now.
+    void schedule_in(int ms);
+
+    void cancel();
+
+    bool pending() const;
+
+    uint64_t deadline() const;
+
+    // Returns the pointer that was passed to the constructor.
+    void* data() const;
+
+    // Moves the wheel forward to 'now', and appends the timers that have
+    // expired to 'expired'. They are no longer pending when returned.
+    static void expire(uint64_t now, std::vector<timer*>& expired);
+
+    // Returns the time at which the wheel next needs to be moved forward,
+    // or 0 if no timers are pending.
+    static uint64_t next();
+
+private:
+    enum {
+        LEVELS     = 4,
+        SLOT_BITS  = 6,
+        SLOTS      = 1 << SLOT_BITS,
+        SLOT_MASK  = SLOTS - 1
+    };
+
+    timer* _next;
+
+    timer* _prev;
+
+    uint64_t _deadline;
+
+    void* _data;
+
+    // Heads of the slot lists (circular, doubly linked), one per slot.
+    static timer _slots[LEVELS][SLOTS];
+
+    // One bit per slot that isn't empty.
+    static uint64_t _bitmap[LEVELS];
+
+    // The next tick (millisecond) of the wheel that hasn't been processed.
+    static uint64_t _tick;
+
+    static void add(timer* t);
+
+    static void unlink(timer* t);
+
+    static void cascade(int level);
+
+    timer(const timer&);
+
+    timer& operator=(const timer&);
+};
+
+NDPPD_NS_END
@@ -0,0 +1,349 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <vector>
+#include <cstring>
+
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <netinet/ip6.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// A path-compressed binary trie mapping IPv6 prefixes to values. Looking
+// up an address visits at most one node per bit of the longest matching
+// prefix, no matter how many prefixes are stored.
+//
+// Several values may be stored under the same prefix. Lookups return
+// matching values in the order they were inserted, so the outcome never
+// depends on the shape of the trie.
+
+template <typename T>
+class trie {
+public:
+    trie() :
+        _root(NULL), _size(0), _seq(0)
+    {
+    }
+
+    ~trie()
+    {
+        clear();
+    }
+
+    // Stores 'value' under the prefix 'addr' (address and mask).
+    void insert(const address& addr, const T& value)
+    {
+        struct in6_addr key;
+        int plen = make_key(addr, key);
+
+        node** link = &_root;
+
+        while (*link) {
+            node* n = *link;
+
+            int len = common(key, n->key, (plen < n->plen) ? plen : n->plen);
+
+            if (len < n->plen) {
+                // The new prefix diverges from 'n' (or is a parent of it),
+                // so we need a new node above 'n'.
+
+                node* m = new node(key, len);
+                m->child[bit(n->key, len)] = n;
+                *link = m;
+
+                if (len < plen) {
+                    node* c = new node(key, plen);
+                    m->child[bit(key, len)] = c;
+                    m = c;
+                }
+
+                m->add(value, _seq++);
+                _size++;
+                return;
+            }
+
+            if (n->plen == plen) {
+                n->add(value, _seq++);
+                _size++;
+                return;
+            }
+
+            link = &n->child[bit(key, n->plen)];
+        }
+
+        *link = new node(key, plen);
+        (*link)->add(value, _seq++);
+        _size++;
+    }
+
+    // Removes 'value' from the prefix 'addr'. Returns false if it
+    // wasn't found.
+    bool remove(const address& addr, const T& value)
+    {
+        struct in6_addr key;
+        int plen = make_key(addr, key);
+
+        bool found = false;
+        _root = remove(_root, key, plen, value, found);
+
+        if (found)
+            _size--;
+
+        return found;
+    }
+
+    void clear()
+    {
+        destroy(_root);
+        _root = NULL;
+        _size = 0;
+    }
+
+    // Exchanges the contents of two tries, which allows a new trie to be
+    // built on the side and then put in place in one go.
+    void swap(trie& other)
+    {
+        node* root  = _root;
+        size_t size = _size;
+        unsigned int seq = _seq;
+
+        _root = other._root;
+        _size = other._size;
+        _seq  = other._seq;
+
+        other._root = root;
+        other._size = size;
+        other._seq  = seq;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    bool empty() const
+    {
+        return !_size;
+    }
+
+    // Appends the values of all prefixes that contain 'addr' to 'values',
+    // in the order they were inserted.
+    void find_all(const address& addr, std::vector<T>& values) const
+    {
+        const struct in6_addr& key = addr.const_addr();
+
+        _matches.clear();
+
+        for (node* n = _root; n; n = n->child[bit(key, n->plen)]) {
+            if (common(key, n->key, n->plen) < n->plen)
+                break;
+
+            for (typename std::vector<entry>::const_iterator it = n->values.begin();
+                    it != n->values.end(); it++) {
+                // Insertion sort by sequence number; there are few matches.
+
+                _matches.push_back(&*it);
+
+                for (size_t i = _matches.size() - 1; (i > 0) && (_matches[i - 1]->seq > it->seq); i--) {
+                    _matches[i]     = _matches[i - 1];
+                    _matches[i - 1] = &*it;
+                }
+            }
+
+            if (n->plen >= 128)
+                break;
+        }
+
+        for (size_t i = 0; i < _matches.size(); i++)
+            values.push_back(_matches[i]->value);
+    }
+
+    // Appends the values stored under exactly the prefix 'addr' (address
+    // and mask) to 'values', in the order they were inserted.
+    void find_exact(const address& addr, std::vector<T>& values) const
+    {
+        struct in6_addr key;
+        int plen = make_key(addr, key);
+
+        for (node* n = _root; n && (n->plen <= plen); n = n->child[bit(key, n->plen)]) {
+            if (common(key, n->key, n->plen) < n->plen)
+                break;
+
+            if (n->plen == plen) {
+                for (typename std::vector<entry>::const_iterator it = n->values.begin();
+                        it != n->values.end(); it++)
+                    values.push_back(it->value);
+                break;
+            }
+        }
+    }
+
+    // Returns the first value stored under the longest prefix that
+    // contains 'addr', or NULL if there is none.
+    const T* find(const address& addr) const
+    {
+        const struct in6_addr& key = addr.const_addr();
+
+        const T* value = NULL;
+
+        for (node* n = _root; n; n = n->child[bit(key, n->plen)]) {
+            if (common(key, n->key, n->plen) < n->plen)
+                break;
+
+            if (!n->values.empty())
+                value = &n->values.front().value;
+
+            if (n->plen >= 128)
+                break;
+        }
+
+        return value;
+    }
+
+private:
+    struct entry {
+        T value;
+        unsigned int seq;
+    };
+
+    struct node {
+        struct in6_addr key;
+        int plen;
+        node* child[2];
+        std::vector<entry> values;
+
+        node(const struct in6_addr& k, int len) :
+            plen(len)
+        {
+            child[0] = child[1] = NULL;
+            mask(k, len, key);
+        }
+
+        void add(const T& value, unsigned int seq)
+        {
+            entry e;
+            e.value = value;
+            e.seq   = seq;
+            values.push_back(e);
+        }
+    };
+
+    node* _root;
+
+    size_t _size;
+
+    unsigned int _seq;
+
+    // Scratch space for find_all(), kept around to avoid reallocating it.
+    mutable std::vector<const entry*> _matches;
+
+    // Returns bit 'i' of 'key', counting from the most significant bit.
+    // Bit 128 is treated as zero so that /128 nodes terminate the walk.
+    static int bit(const struct in6_addr& key, int i)
+    {
+        if (i >= 128)
+            return 0;
+
+        return (key.s6_addr[i >> 3] >> (7 - (i & 7))) & 1;
+    }
+
+    // Returns the number of leading bits, up to 'max', that 'a' and 'b'
+    // have in common.
+    static int common(const struct in6_addr& a, const struct in6_addr& b, int max)
+    {
+        for (int i = 0; i < 4; i++) {
+            uint32_t x = ntohl(a.s6_addr32[i] ^ b.s6_addr32[i]);
+
+            if (x) {
+                int len = i * 32 + __builtin_clz(x);
+                return (len < max) ? len : max;
+            }
+
+            if ((i + 1) * 32 >= max)
+                break;
+        }
+
+        return max;
+    }
+
+    static void mask(const struct in6_addr& k, int len, struct in6_addr& key)
+    {
+        memset(&key, 0, sizeof(key));
+
+        int bytes = len >> 3;
+
+        memcpy(&key, &k, bytes);
+
+        if (len & 7)
+            key.s6_addr[bytes] = k.s6_addr[bytes] & (0xff << (8 - (len & 7)));
+    }
+
+    static int make_key(const address& addr, struct in6_addr& key)
+    {
+        int plen = addr.prefix();
+        mask(addr.const_addr(), plen, key);
+        return plen;
+    }
+
+    static node* remove(node* n, const struct in6_addr& key, int plen, const T& value, bool& found)
+    {
+        if (!n || (n->plen > plen) || (common(key, n->key, n->plen) < n->plen))
+            return n;
+
+        if (n->plen < plen) {
+            int b = bit(key, n->plen);
+            n->child[b] = remove(n->child[b], key, plen, value, found);
+        } else {
+            for (typename std::vector<entry>::iterator it = n->values.begin();
+                    it != n->values.end(); it++) {
+                if (it->value == value) {
+                    n->values.erase(it);
+                    found = true;
+                    break;
+                }
+            }
+        }
+
+        // Nodes without values are only needed to branch.
+
+        if (!n->values.empty() || (n->child[0] && n->child[1]))
+            return n;
+
+        node* c = n->child[0] ? n->child[0] : n->child[1];
+        delete n;
+        return c;
+    }
+
+    static void destroy(node* n)
+    {
+        if (!n)
+            return;
+
+        destroy(n->child[0]);
+        destroy(n->child[1]);
+        delete n;
+    }
+
+    trie(const trie&);
+
+    trie& operator=(const trie&);
+};
+
+NDPPD_NS_END
@@ -0,0 +1,569 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#include "ndppd.h"
+#include "xdp.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+NDPPD_NS_BEGIN
+
+static int sys_bpf(int cmd, union bpf_attr* attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static struct bpf_insn insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+{
+    struct bpf_insn i;
+
+    memset(&i, 0, sizeof(i));
+    i.code    = code;
+    i.dst_reg = dst;
+    i.src_reg = src;
+    i.off     = off;
+    i.imm     = imm;
+
+    return i;
+}
+
+// Returns the number of receive queues of the interface 'ifname'.
+static int rx_queues(const std::string& ifname)
+{
+    DIR* dir = opendir(("/sys/class/net/" + ifname + "/queues").c_str());
+
+    if (!dir)
+        return 1;
+
+    int count = 0;
+
+    struct dirent* de;
+
+    while ((de = readdir(dir))) {
+        if (!strncmp(de->d_name, "rx-", 3))
+            count++;
+    }
+
+    closedir(dir);
+
+    return count ? count : 1;
+}
+
+// Key of the prefix map; the layout the kernel expects for LPM tries.
+struct lpm_key {
+    uint32_t prefixlen;
+    uint8_t addr[16];
+};
+
+xsk::xsk() :
+    _fd(-1), _queue(0), _umem(NULL)
+{
+    memset(&_rx, 0, sizeof(_rx));
+    memset(&_fill, 0, sizeof(_fill));
+    memset(&_comp, 0, sizeof(_comp));
+}
+
+xsk::~xsk()
+{
+    if (_fd >= 0) {
+        loop::remove(_fd);
+        close(_fd);
+    }
+
+    unmap_ring(_rx);
+    unmap_ring(_fill);
+    unmap_ring(_comp);
+
+    if (_umem)
+        munmap(_umem, XSK_FRAME_NR * XSK_FRAME_SIZE);
+}
+
+ptr<xsk> xsk::open(int ifindex, int queue)
+{
+    ptr<xsk> xs(new xsk());
+
+    xs->_queue = queue;
+
+    if ((xs->_fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0)) < 0) {
+        logger::error() << "Unable to create AF_XDP socket: " << logger::err();
+        return ptr<xsk>();
+    }
+
+    void* umem = mmap(NULL, XSK_FRAME_NR * XSK_FRAME_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (umem == MAP_FAILED) {
+        logger::error() << "xsk::open() failed to allocate UMEM: " << logger::err();
+        return ptr<xsk>();
+    }
+
+    xs->_umem = (uint8_t* )umem;
+
+    struct xdp_umem_reg reg;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.addr       = (uint64_t)(uintptr_t)umem;
+    reg.len        = XSK_FRAME_NR * XSK_FRAME_SIZE;
+    reg.chunk_size = XSK_FRAME_SIZE;
+
+    if (setsockopt(xs->_fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0) {
+        logger::error() << "xsk::open() failed XDP_UMEM_REG: " << logger::err();
+        return ptr<xsk>();
+    }
+
+    // We only receive, but the kernel wants a completion ring regardless.
+
+    int fill_size = XSK_FRAME_NR, comp_size = 64, rx_size = XSK_FRAME_NR;
+
+    if ((setsockopt(xs->_fd, SOL_XDP, XDP_UMEM_FILL_RING, &fill_size, sizeof(fill_size)) < 0) ||
+        (setsockopt(xs->_fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &comp_size, sizeof(comp_size)) < 0) ||
+        (setsockopt(xs->_fd, SOL_XDP, XDP_RX_RING, &rx_size, sizeof(rx_size)) < 0)) {
+        logger::error() << "xsk::open() failed to set up rings: " << logger::err();
+        return ptr<xsk>();
+    }
+
+    struct xdp_mmap_offsets off;
+    socklen_t len = sizeof(off);
+
+    if (getsockopt(xs->_fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len) < 0) {
+        logger::error() << "xsk::open() failed XDP_MMAP_OFFSETS: " << logger::err();
+        return ptr<xsk>();
+    }
+
+    if (!xs->map_ring(xs->_fill, fill_size, off.fr, XDP_UMEM_PGOFF_FILL_RING, sizeof(uint64_t)) ||
+        !xs->map_ring(xs->_comp, comp_size, off.cr, XDP_UMEM_PGOFF_COMPLETION_RING, sizeof(uint64_t)) ||
+        !xs->map_ring(xs->_rx, rx_size, off.rx, XDP_PGOFF_RX_RING, sizeof(struct xdp_desc))) {
+        return ptr<xsk>();
+    }
+
+    // Give all the frames to the kernel to fill.
+
+    uint64_t* fill = (uint64_t* )xs->_fill.desc;
+
+    for (uint32_t i = 0; i < XSK_FRAME_NR; i++)
+        fill[i] = (uint64_t)i * XSK_FRAME_SIZE;
+
+    __atomic_store_n(xs->_fill.producer, XSK_FRAME_NR, __ATOMIC_RELEASE);
+
+    // Generic mode can't do zero-copy, so ask for copy mode outright.
+
+    struct sockaddr_xdp sxdp;
+
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family   = AF_XDP;
+    sxdp.sxdp_flags    = XDP_COPY;
+    sxdp.sxdp_ifindex  = ifindex;
+    sxdp.sxdp_queue_id = queue;
+
+    if (bind(xs->_fd, (struct sockaddr* )&sxdp, sizeof(sxdp)) < 0) {
+        logger::error() << "xsk::open() failed to bind to queue " << queue << ": " << logger::err();
+        return ptr<xsk>();
+    }
+
+    return xs;
+}
+
+bool xsk::map_ring(ring& r, int size, const struct xdp_ring_offset& off, uint64_t pgoff, size_t desc_size)
+{
+    r.len = off.desc + size * desc_size;
+    r.map = mmap(NULL, r.len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, pgoff);
+
+    if (r.map == MAP_FAILED) {
+        logger::error() << "xsk::map_ring() failed mmap: " << logger::err();
+        r.map = NULL;
+        return false;
+    }
+
+    r.producer = (uint32_t* )((uint8_t* )r.map + off.producer);
+    r.consumer = (uint32_t* )((uint8_t* )r.map + off.consumer);
+    r.desc     = (uint8_t* )r.map + off.desc;
+    r.mask     = size - 1;
+
+    return true;
+}
+
+void xsk::unmap_ring(ring& r)
+{
+    if (r.map)
+        munmap(r.map, r.len);
+
+    r.map = NULL;
+}
+
+int xsk::fd() const
+{
+    return _fd;
+}
+
+int xsk::queue() const
+{
+    return _queue;
+}
+
+uint64_t xsk::drops() const
+{
+    struct xdp_statistics st;
+    socklen_t len = sizeof(st);
+
+    if (getsockopt(_fd, SOL_XDP, XDP_STATISTICS, &st, &len) < 0)
+        return 0;
+
+    return st.rx_dropped + st.rx_ring_full;
+}
+
+int xsk::receive(int max)
+{
+    uint32_t prod = __atomic_load_n(_rx.producer, __ATOMIC_ACQUIRE);
+    uint32_t n    = prod - *_rx.consumer;
+
+    return (n < (uint32_t)max) ? (int)n : max;
+}
+
+const uint8_t* xsk::frame(int i, size_t& len) const
+{
+    const struct xdp_desc* desc = (const struct xdp_desc* )_rx.desc;
+    const struct xdp_desc& d    = desc[(*_rx.consumer + i) & _rx.mask];
+
+    len = d.len;
+
+    return _umem + d.addr;
+}
+
+void xsk::release(int n)
+{
+    const struct xdp_desc* desc = (const struct xdp_desc* )_rx.desc;
+
+    uint64_t* fill = (uint64_t* )_fill.desc;
+
+    uint32_t cons = *_rx.consumer;
+    uint32_t prod = *_fill.producer;
+
+    // There are as many slots in the fill ring as there are frames, so
+    // there's always room for the ones we hand back.
+
+    for (int i = 0; i < n; i++) {
+        uint64_t addr = desc[(cons + i) & _rx.mask].addr;
+        fill[(prod + i) & _fill.mask] = addr & ~((uint64_t)XSK_FRAME_SIZE - 1);
+    }
+
+    __atomic_store_n(_fill.producer, prod + n, __ATOMIC_RELEASE);
+    __atomic_store_n(_rx.consumer, cons + n, __ATOMIC_RELEASE);
+}
+
+xdp::xdp() :
+    _lpm_fd(-1), _xsks_fd(-1), _prog_fd(-1), _link_fd(-1)
+{
+}
+
+xdp::~xdp()
+{
+    // Closing the link detaches the program.
+
+    if (_link_fd >= 0)
+        close(_link_fd);
+
+    _sockets.clear();
+
+    if (_prog_fd >= 0)
+        close(_prog_fd);
+
+    if (_xsks_fd >= 0)
+        close(_xsks_fd);
+
+    if (_lpm_fd >= 0)
+        close(_lpm_fd);
+}
+
+ptr<xdp> xdp::open(const std::string& ifname)
+{
+    ptr<xdp> xd(new xdp());
+
+    xd->_ifname = ifname;
+
+    int ifindex = if_nametoindex(ifname.c_str());
+
+    if (!ifindex) {
+        logger::error() << "xdp::open() unknown interface '" << ifname << "'";
+        return ptr<xdp>();
+    }
+
+    int queues = rx_queues(ifname);
+
+    union bpf_attr attr;
+
+    // The prefixes to redirect, and what to do with them (1 = redirect,
+    // 0 = pass). The longest match wins.
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type    = BPF_MAP_TYPE_LPM_TRIE;
+    attr.key_size    = sizeof(struct lpm_key);
+    attr.value_size  = sizeof(uint32_t);
+    attr.max_entries = XDP_MAX_PREFIXES * 2;
+    attr.map_flags   = BPF_F_NO_PREALLOC;
+
+    if ((xd->_lpm_fd = sys_bpf(BPF_MAP_CREATE, &attr)) < 0) {
+        logger::error() << "xdp::open() failed to create prefix map: " << logger::err();
+        return ptr<xdp>();
+    }
+
+    // The AF_XDP sockets, by receive queue.
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type    = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size    = sizeof(uint32_t);
+    attr.value_size  = sizeof(uint32_t);
+    attr.max_entries = queues;
+
+    if ((xd->_xsks_fd = sys_bpf(BPF_MAP_CREATE, &attr)) < 0) {
+        logger::error() << "xdp::open() failed to create socket map: " << logger::err();
+        return ptr<xdp>();
+    }
+
+    for (int q = 0; q < queues; q++) {
+        ptr<xsk> xs = xsk::open(ifindex, q);
+
+        if (!xs)
+            return ptr<xdp>();
+
+        uint32_t key = q, value = xs->fd();
+
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = xd->_xsks_fd;
+        attr.key    = (uint64_t)(uintptr_t)&key;
+        attr.value  = (uint64_t)(uintptr_t)&value;
+
+        if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+            logger::error() << "xdp::open() failed to add socket to map: " << logger::err();
+            return ptr<xdp>();
+        }
+
+        xd->_sockets.push_back(xs);
+    }
+
+    if (!xd->load())
+        return ptr<xdp>();
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd        = xd->_prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type    = BPF_XDP;
+    attr.link_create.flags          = XDP_FLAGS_SKB_MODE;
+
+    if ((xd->_link_fd = sys_bpf(BPF_LINK_CREATE, &attr)) < 0) {
+        logger::error() << "xdp::open() failed to attach program to '" << ifname << "': " << logger::err();
+        return ptr<xdp>();
+    }
+
+    logger::debug() << "xdp::open() ifname=" << ifname << ", queues=" << queues;
+
+    return xd;
+}
+
+bool xdp::load()
+{
+    // Offsets into the frame; the program only deals with solicits that
+    // directly follow the IPv6 header.
+    const int16_t nxt    = sizeof(struct ether_header) + 6;
+    const int16_t type   = sizeof(struct ether_header) + 40;
+    const int16_t target = type + 8;
+
+    std::vector<struct bpf_insn> code;
+
+    // Jumps to the final "pass", patched once we know where it is.
+    std::vector<size_t> pass;
+
+    // r6 = ctx, r2 = data, r3 = data_end.
+    code.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0));
+    code.push_back(insn(BPF_LDX | BPF_W | BPF_MEM, 2, 1, offsetof(struct xdp_md, data), 0));
+    code.push_back(insn(BPF_LDX | BPF_W | BPF_MEM, 3, 1, offsetof(struct xdp_md, data_end), 0));
+
+    // Pass if the frame is too short to be a solicit.
+    code.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0));
+    code.push_back(insn(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, target + 16));
+    pass.push_back(code.size());
+    code.push_back(insn(BPF_JMP | BPF_JGT | BPF_X, 4, 3, 0, 0));
+
+    // Pass unless it's ETHERTYPE_IPV6, IPPROTO_ICMPV6 and ND_NEIGHBOR_SOLICIT.
+    code.push_back(insn(BPF_LDX | BPF_H | BPF_MEM, 5, 2, offsetof(struct ether_header, ether_type), 0));
+    pass.push_back(code.size());
+    code.push_back(insn(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 0, htons(ETHERTYPE_IPV6)));
+
+    code.push_back(insn(BPF_LDX | BPF_B | BPF_MEM, 5, 2, nxt, 0));
+    pass.push_back(code.size());
+    code.push_back(insn(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 0, IPPROTO_ICMPV6));
+
+    code.push_back(insn(BPF_LDX | BPF_B | BPF_MEM, 5, 2, type, 0));
+    pass.push_back(code.size());
+    code.push_back(insn(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 0, 135));
+
+    // Build a struct lpm_key for the target on the stack.
+    code.push_back(insn(BPF_ST | BPF_W | BPF_MEM, 10, 0, -20, 128));
+
+    for (int16_t i = 0; i < 16; i += 4) {
+        code.push_back(insn(BPF_LDX | BPF_W | BPF_MEM, 5, 2, target + i, 0));
+        code.push_back(insn(BPF_STX | BPF_W | BPF_MEM, 10, 5, -16 + i, 0));
+    }
+
+    // r0 = bpf_map_lookup_elem(lpm, &key); pass unless it says 1.
+    code.push_back(insn(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, _lpm_fd));
+    code.push_back(insn(0, 0, 0, 0, 0));
+    code.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, 2, 10, 0, 0));
+    code.push_back(insn(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, -20));
+    code.push_back(insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem));
+    pass.push_back(code.size());
+    code.push_back(insn(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 0, 0));
+    code.push_back(insn(BPF_LDX | BPF_W | BPF_MEM, 5, 0, 0, 0));
+    pass.push_back(code.size());
+    code.push_back(insn(BPF_JMP | BPF_JEQ | BPF_K, 5, 0, 0, 0));
+
+    // return bpf_redirect_map(xsks, ctx->rx_queue_index, XDP_PASS);
+    code.push_back(insn(BPF_LDX | BPF_W | BPF_MEM, 2, 6, offsetof(struct xdp_md, rx_queue_index), 0));
+    code.push_back(insn(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, _xsks_fd));
+    code.push_back(insn(0, 0, 0, 0, 0));
+    code.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS));
+    code.push_back(insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map));
+    code.push_back(insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    // return XDP_PASS;
+    for (std::vector<size_t>::iterator it = pass.begin(); it != pass.end(); it++)
+        code[*it].off = code.size() - (*it + 1);
+
+    code.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS));
+    code.push_back(insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    static char log[4096];
+
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type            = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insns                = (uint64_t)(uintptr_t)&code[0];
+    attr.insn_cnt             = code.size();
+    attr.license              = (uint64_t)(uintptr_t)"GPL";
+    attr.log_buf              = (uint64_t)(uintptr_t)log;
+    attr.log_size             = sizeof(log);
+    attr.log_level            = 1;
+    strncpy(attr.prog_name, "ndppd", sizeof(attr.prog_name) - 1);
+
+    log[0] = '\0';
+
+    if ((_prog_fd = sys_bpf(BPF_PROG_LOAD, &attr)) < 0) {
+        logger::error() << "xdp::load() failed to load program: " << logger::err();
+        logger::debug() << log;
+        return false;
+    }
+
+    return true;
+}
+
+bool xdp::set_prefix(const address& addr, uint32_t value)
+{
+    struct lpm_key key;
+
+    key.prefixlen = addr.prefix();
+    memcpy(key.addr, &addr.const_addr(), sizeof(key.addr));
+
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = _lpm_fd;
+    attr.key    = (uint64_t)(uintptr_t)&key;
+    attr.value  = (uint64_t)(uintptr_t)&value;
+
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+        logger::error() << "xdp::set_prefix() failed for " << addr.to_string() << ": " << logger::err();
+        return false;
+    }
+
+    _keys.push_back(addr);
+
+    return true;
+}
+
+bool xdp::del_prefix(const address& addr)
+{
+    struct lpm_key key;
+
+    key.prefixlen = addr.prefix();
+    memcpy(key.addr, &addr.const_addr(), sizeof(key.addr));
+
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = _lpm_fd;
+    attr.key    = (uint64_t)(uintptr_t)&key;
+
+    return (sys_bpf(BPF_MAP_DELETE_ELEM, &attr) == 0) || (errno == ENOENT);
+}
+
+bool xdp::update(const std::vector<address>& prefixes, const std::vector<address>& pass)
+{
+    // Start over. In between, the solicits go the usual way and are
+    // picked up by the PF_PACKET socket, so none are lost.
+
+    for (std::vector<address>::iterator it = _keys.begin(); it != _keys.end(); it++)
+        del_prefix(*it);
+
+    _keys.clear();
+
+    if ((prefixes.size() > XDP_MAX_PREFIXES) || (pass.size() > XDP_MAX_PREFIXES)) {
+        logger::warning() << "Too many prefixes to redirect with XDP on interface '" << _ifname << "'";
+        return false;
+    }
+
+    for (std::vector<address>::const_iterator it = prefixes.begin(); it != prefixes.end(); it++)
+        set_prefix(*it, 1);
+
+    for (std::vector<address>::const_iterator it = pass.begin(); it != pass.end(); it++)
+        set_prefix(address(it->const_addr()), 0);
+
+    logger::debug() << "xdp::update() ifname=" << _ifname << ", prefixes=" << prefixes.size()
+                    << ", pass=" << pass.size();
+
+    return true;
+}
+
+const std::vector<ptr<xsk> >& xdp::sockets() const
+{
+    return _sockets;
+}
+
+NDPPD_NS_END
@@ -0,0 +1,128 @@
+// ndppd - NDP Proxy Daemon
+// Copyright (C) 2011  Daniel Adolfsson <daniel@priv.nu>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/if_xdp.h>
+
+#include "ndppd.h"
+
+NDPPD_NS_BEGIN
+
+// Number of frames in the UMEM of each socket, and the size of a frame.
+#define XSK_FRAME_NR   512
+#define XSK_FRAME_SIZE 2048
+
+// Maximum number of prefixes the XDP program redirects.
+#define XDP_MAX_PREFIXES 1024
+
+// An AF_XDP socket bound to a single receive queue of an interface, with
+// a UMEM of its own. The kernel copies the frames that the XDP program
+// redirects to the socket into the UMEM, and we read them from there
+// without any further copying.
+
+class xsk {
+public:
+    static ptr<xsk> open(int ifindex, int queue);
+
+    ~xsk();
+
+    int fd() const;
+
+    int queue() const;
+
+    // Returns the number of frames the kernel has dropped since the
+    // socket was opened, for want of room in the receive ring or UMEM.
+    uint64_t drops() const;
+
+    // Returns the number of frames, up to 'max', that are waiting in the
+    // receive ring. They stay put until release() is called.
+    int receive(int max);
+
+    // Returns frame 'i' of the ones returned by receive().
+    const uint8_t* frame(int i, size_t& len) const;
+
+    // Hands the first 'n' frames back to the kernel.
+    void release(int n);
+
+private:
+    struct ring {
+        uint32_t* producer;
+        uint32_t* consumer;
+        void* desc;
+        uint32_t mask;
+        size_t len;
+        void* map;
+    };
+
+    int _fd;
+
+    int _queue;
+
+    uint8_t* _umem;
+
+    ring _rx, _fill, _comp;
+
+    xsk();
+
+    bool map_ring(ring& r, int size, const struct xdp_ring_offset& off, uint64_t pgoff, size_t desc_size);
+
+    static void unmap_ring(ring& r);
+};
+
+// The XDP program attached (in generic mode) to a listening interface.
+// It redirects the solicits for targets that match one of the prefixes
+// given to update() into the AF_XDP socket of the queue they arrived on.
+// Everything else is passed on, so the kernel and the PF_PACKET socket
+// see it as usual.
+
+class xdp {
+public:
+    static ptr<xdp> open(const std::string& ifname);
+
+    ~xdp();
+
+    // Replaces the prefixes that are redirected. Solicits for the
+    // addresses in 'pass' are never redirected, since the kernel needs
+    // to answer them itself.
+    bool update(const std::vector<address>& prefixes, const std::vector<address>& pass);
+
+    const std::vector<ptr<xsk> >& sockets() const;
+
+private:
+    std::string _ifname;
+
+    int _lpm_fd, _xsks_fd, _prog_fd, _link_fd;
+
+    std::vector<ptr<xsk> > _sockets;
+
+    // Keys currently in the prefix map.
+    std::vector<address> _keys;
+
+    xdp();
+
+    bool load();
+
+    bool set_prefix(const address& addr, uint32_t value);
+
+    bool del_prefix(const address& addr);
+};
+
+NDPPD_NS_END